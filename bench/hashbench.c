@@ -0,0 +1,97 @@
+//
+// string hash throughput: hashes sets of short and long keys repeatedly
+// with hashBytes and with the byte at a time FNV-1a strings used before,
+// and reports millions of keys and MB per second for each.
+//   hashbench [iterations]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common.h"
+#include "../hash.h"
+
+#define KEY_COUNT 4096
+
+static uint32_t fnv1a(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+typedef uint32_t (*HashFn)(const char* bytes, int length);
+
+// keys of minLength to maxLength bytes, letters and digits like names
+static char** makeKeys(int minLength, int maxLength, int* lengths) {
+    static const char alphabet[] =
+            "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    char** keys = (char**)malloc(sizeof(char*) * KEY_COUNT);
+    if (keys == NULL) exit(1);
+    for (int i = 0; i < KEY_COUNT; i++) {
+        int length = minLength + rand() % (maxLength - minLength + 1);
+        keys[i] = (char*)malloc((size_t)length + 1);
+        if (keys[i] == NULL) exit(1);
+        for (int j = 0; j < length; j++) {
+            keys[i][j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+        }
+        keys[i][length] = '\0';
+        lengths[i] = length;
+    }
+    return keys;
+}
+
+static void run(const char* name, HashFn hash, char** keys,
+                const int* lengths, int iterations) {
+    size_t bytes = 0;
+    uint32_t checksum = 0;
+    clock_t start = clock();
+    for (int i = 0; i < iterations; i++) {
+        for (int j = 0; j < KEY_COUNT; j++) {
+            checksum += hash(keys[j], lengths[j]);
+            bytes += (size_t)lengths[j];
+        }
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    double keyCount = (double)KEY_COUNT * iterations;
+    printf("  %-9s %8.1f M keys/s %9.1f MB/s  (checksum %08x)\n", name,
+           keyCount / seconds / 1e6, (double)bytes / seconds / (1024 * 1024),
+           checksum);
+}
+
+int main(int argc, const char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    if (iterations < 1) {
+        fprintf(stderr, "Usage: hashbench [iterations]\n");
+        exit(64);
+    }
+    srand(1);
+    setHashSeed(randomHashSeed());
+
+    static const struct {
+        const char* name;
+        int minLength;
+        int maxLength;
+        int scale;
+    } sets[] = {
+        {"short keys, 4 to 16 bytes", 4, 16, 1},
+        {"long keys, 1 KB", 1024, 1024, 64},
+    };
+    for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        int* lengths = (int*)malloc(sizeof(int) * KEY_COUNT);
+        if (lengths == NULL) exit(1);
+        char** keys = makeKeys(sets[i].minLength, sets[i].maxLength, lengths);
+        printf("%s\n", sets[i].name);
+        int count = iterations / sets[i].scale > 0
+                            ? iterations / sets[i].scale : 1;
+        run("fnv1a", fnv1a, keys, lengths, count);
+        run("hashBytes", hashBytes, keys, lengths, count);
+        for (int j = 0; j < KEY_COUNT; j++) free(keys[j]);
+        free(keys);
+        free(lengths);
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+//
+// writes a program of many modules for timing --jobs: dir/main.lox imports
+// dir/lib/m0.lox .. m<count-1>.lox, which import each other as a binary tree
+// and each define the given number of functions. main then calls into
+// every module.
+//   modulegen dir [modules] [functions]
+//   CLoxLab dir/main.lox  against  CLoxLab --jobs 4 dir/main.lox
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define makeDirectory(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define makeDirectory(path) mkdir(path, 0777)
+#endif
+
+#define PATH_LENGTH 4096
+
+static FILE* openFile(const char* dir, const char* name) {
+    char path[PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write file \"%s\".\n", path);
+        exit(74);
+    }
+    return file;
+}
+
+static void writeModule(const char* lib, int index, int count,
+                        int functionCount) {
+    char name[64];
+    snprintf(name, sizeof(name), "m%d.lox", index);
+    FILE* file = openFile(lib, name);
+    // a binary tree over the modules, shallow enough for the frame stack,
+    // and an import of itself
+    for (int child = 2 * index + 1; child <= 2 * index + 2; child++) {
+        if (child < count) {
+            fprintf(file, "import \"m%d.lox\" as m%d;\n", child, child);
+        }
+    }
+    fprintf(file, "import \"m%d.lox\";\n", index);
+    fprintf(file, "var name = \"m%d\";\n", index);
+    for (int i = 0; i < functionCount; i++) {
+        fprintf(file,
+                "fun f%d(a, b) {\n"
+                "  var s = \"shared\" + name;\n"
+                "  for (var i = 0; i < a; i = i + 1) {\n"
+                "    if (i > b) s = s + \"x\"; else b = b - 1;\n"
+                "  }\n"
+                "  if (a > b) return a - b + %d;\n"
+                "  return b * 2 + %d;\n"
+                "}\n",
+                i, i, i);
+    }
+    fprintf(file, "fun run() {\n  var total = 0;\n");
+    for (int i = 0; i < functionCount; i += functionCount / 8 + 1) {
+        fprintf(file, "  total = total + f%d(3, 1);\n", i);
+    }
+    fprintf(file, "  return total;\n}\n");
+    fclose(file);
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: modulegen dir [modules] [functions]\n");
+        exit(64);
+    }
+    const char* dir = argv[1];
+    int count = argc > 2 ? atoi(argv[2]) : 64;
+    int functionCount = argc > 3 ? atoi(argv[3]) : 100;
+    // a module's globals and the main script's imports share 256 constants
+    if (count < 1 || count > 64 || functionCount < 1 ||
+        functionCount > 100) {
+        fprintf(stderr, "Usage: modulegen dir [modules] [functions]\n");
+        exit(64);
+    }
+
+    char lib[PATH_LENGTH];
+    snprintf(lib, sizeof(lib), "%s/lib", dir);
+    makeDirectory(dir);
+    makeDirectory(lib);
+    for (int i = 0; i < count; i++) {
+        writeModule(lib, i, count, functionCount);
+    }
+
+    FILE* main = openFile(dir, "main.lox");
+    for (int i = 0; i < count; i++) {
+        fprintf(main, "import \"lib/m%d.lox\" as m%d;\n", i, i);
+    }
+    // in a function, the main chunk's constants go to the imports
+    fprintf(main, "fun runAll() {\n  var total = 0;\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(main, "  total = total + m%d.run();\n", i);
+    }
+    fprintf(main, "  return total;\n}\nprint runAll();\n");
+    fclose(main);
+    return 0;
+}
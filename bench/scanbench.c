@@ -0,0 +1,75 @@
+//
+// scanner throughput benchmark: scans a source file repeatedly and reports MB/s.
+// built twice, with and without SCANNER_NO_SIMD, to compare both paths.
+//   scanbench [--dump] path [iterations]
+// --dump prints every token, to check both builds produce identical output.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common.h"
+#include "../scanner.h"
+
+static char* readFile(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(*size + 1);
+    if (buffer == NULL || fread(buffer, 1, *size, file) < *size) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    buffer[*size] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+int main(int argc, const char* argv[]) {
+    bool dump = argc > 1 && strcmp(argv[1], "--dump") == 0;
+    if (dump) {
+        argc--;
+        argv++;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "Usage: scanbench [--dump] path [iterations]\n");
+        exit(64);
+    }
+
+    size_t size;
+    char* source = readFile(argv[1], &size);
+    int iterations = dump ? 1 : (argc > 2 ? atoi(argv[2]) : 20);
+
+    long tokens = 0;
+    unsigned long checksum = 0;
+    clock_t start = clock();
+    for (int i = 0; i < iterations; i++) {
+        initScanner(source);
+        for (;;) {
+            Token token = scanToken();
+            tokens++;
+            checksum = checksum * 31 + token.type * 7 + token.length + token.line;
+            if (dump) {
+                printf("%d %d %d %.*s\n", token.line, token.type,
+                       token.length, token.length, token.start);
+            }
+            if (token.type == TOKEN_EOF) break;
+        }
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    if (!dump) {
+        printf("%ld tokens, checksum %lx, %.1f MB/s\n", tokens / iterations,
+               checksum, (double)size * iterations / seconds / (1024 * 1024));
+    }
+    free(source);
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
-#include ".\memory.h"
+#include "memory.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk) {
@@ -9,6 +10,7 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->packed = false;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -26,14 +28,58 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     chunk->count++;
 }
 
-void freeChunk(Chunk* chunk) {
+static size_t packedSize(int count, int constantCount) {
+    return sizeof(Value) * constantCount +
+           (sizeof(int) + sizeof(uint8_t)) * count;
+}
+
+void packChunk(Chunk* chunk) {
+    if (chunk->packed || chunk->count == 0) return;
+    int count = chunk->count;
+    int constantCount = chunk->constants.count;
+    // may collect, the arrays are still the chunk's
+    uint8_t* block = (uint8_t*)reallocate(NULL, 0,
+                                          packedSize(count, constantCount));
+    Value* constants = (Value*)block;
+    int* lines = (int*)(constants + constantCount);
+    uint8_t* code = (uint8_t*)(lines + count);
+    if (constantCount > 0) {
+        memcpy(constants, chunk->constants.values,
+               sizeof(Value) * constantCount);
+    }
+    memcpy(lines, chunk->lines, sizeof(int) * count);
+    memcpy(code, chunk->code, count);
+
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->capacity = count;
+    chunk->constants.values = constants;
+    chunk->constants.count = constantCount;
+    chunk->constants.capacity = constantCount;
+    chunk->packed = true;
+}
+
+void freeChunk(Chunk* chunk) {
+    if (chunk->packed) {
+        reallocate(chunk->constants.values, packedSize(chunk->capacity,
+                   chunk->constants.capacity), 0);
+    } else {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+        freeValueArray(&chunk->constants);
+    }
     initChunk(chunk);
 }
 
 int addConstant(Chunk* chunk, Value value) {
+    // compile workers allocate into a local heap, which isn't collected
+    if (localHeap != NULL) {
+        writeValueArray(&chunk->constants, value);
+        return chunk->constants.count - 1;
+    }
     push(value);
     writeValueArray(&chunk->constants, value);
     pop();
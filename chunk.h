@@ -47,6 +47,11 @@ typedef enum {
     OP_INHERIT,
     OP_GET_SUPER,
     OP_SUPER_INVOKE,
+    OP_IMPORT,
+    // the operand is the element count, they're on the stack in order
+    OP_BUILD_LIST,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
 } OpCode;
 
 typedef struct {
@@ -56,10 +61,17 @@ typedef struct {
     //line number
     int* lines;
     ValueArray constants;
+    // constants, lines and code share one block, see packChunk
+    bool packed;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+/**
+ * a finished chunk moves its three arrays into one block sized to fit,
+ * nothing is written to it afterwards
+ */
+void packChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
 #endif
\ No newline at end of file
@@ -13,8 +13,24 @@
 //#define DEBUG_TRACE_EXECUTION
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// compiler state is per thread, modules can be compiled on worker threads
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 // for GC testing
 //#define DEBUG_STRESS_GC
 
 //#define DEBUG_LOG_GC
+
+// scanner uses SSE2/AVX2 lanes when the target has them, force the scalar path
+//#define SCANNER_NO_SIMD
+
+// tables match a group of control bytes with SSE2, force the word at a time path
+//#define TABLE_NO_SIMD
+
+// small blocks come from size class slabs, malloc everything instead (for ASan)
+//#define SLAB_USE_MALLOC
 #endif
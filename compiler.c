@@ -1,6 +1,7 @@
 //
 // Created by lc on 2022/12/8.
 //
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,6 +48,8 @@ typedef struct {
 typedef struct {
     uint8_t index;
     bool isLocal;
+    // kept for lazy bodies, which resolve their captures by name later
+    Token name;
 } Upvalue;
 
 typedef enum {
@@ -68,6 +71,10 @@ typedef struct Compiler {
     int localCount;
     int scopeDepth;
     Upvalue upvalues[UINT8_COUNT];
+    // when compiling a lazy body, names of the upvalues fixed by the first pass
+    ObjString** lazyUpvalues;
+    // lazy first pass: the body is parsed for errors and captures, no code
+    bool checkOnly;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -76,21 +83,36 @@ typedef struct ClassCompiler {
 } ClassCompiler;
 
 
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *currentClass = NULL;
+// modules compiled on worker threads report whole errors and chunks at a time
+#ifdef _WIN32
+#define LOCK_STREAM(stream) _lock_file(stream)
+#define UNLOCK_STREAM(stream) _unlock_file(stream)
+#else
+#define LOCK_STREAM(stream) flockfile(stream)
+#define UNLOCK_STREAM(stream) funlockfile(stream)
+#endif
+
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Compiler *current = NULL;
+THREAD_LOCAL ClassCompiler *currentClass = NULL;
+// module the functions being compiled belong to
+THREAD_LOCAL ObjModule *currentModule = NULL;
+// errors of a module compiled ahead of time, see logCompileErrors
+THREAD_LOCAL char **errorLog = NULL;
 
 static Chunk *currentChunk() {
     return &current->function->chunk;
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type);
+static void initCompiler(Compiler *compiler, FunctionType type,
+                         ObjFunction* function);
 
 static bool check(TokenType type);
 
 static void error(const char *message);
 
 static  ObjFunction* endCompiler();
+static void rescanFunction(ObjFunction* function);
 
 static void advance();
 
@@ -146,11 +168,12 @@ static void addLocal(Token name);
 
 static Token syntheticToken(const char* text);
 
-ObjFunction* compile(const char* source) {
+ObjFunction* compile(const char* source, ObjModule* module) {
     initScanner(source);
+    currentModule = module;
 
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
     parser.hadError = false;
     parser.panicMode = false;
@@ -161,6 +184,7 @@ ObjFunction* compile(const char* source) {
     }
 
     ObjFunction* function = endCompiler();
+    currentModule = NULL;
     return parser.hadError ? NULL : function;
 }
 
@@ -249,6 +273,38 @@ static void classDeclaration() {
     currentClass = currentClass->enclosing;
 }
 
+static uint8_t parseVariable(const char *errorMessage);
+
+/**
+ * import "path" [as name];
+ * at runtime OP_IMPORT leaves the module and the result of running its
+ * top level code (or nil when already loaded) on the stack.
+ */
+static void importDeclaration() {
+    consume(TOKEN_STRING, "Expect module path after 'import'.");
+    uint8_t path = makeConstant(OBJ_VAL(copyString(parser.previous.start + 1,
+                                                   parser.previous.length - 2)));
+
+    // 'as' is only a keyword here
+    bool bind = check(TOKEN_IDENTIFIER) && parser.current.length == 2 &&
+                memcmp(parser.current.start, "as", 2) == 0;
+    uint8_t global = 0;
+    if (bind) {
+        advance();
+        global = parseVariable("Expect module name after 'as'.");
+    }
+    consume(TOKEN_SEMICOLON, "Expect ';' after import.");
+
+    emitBytes(OP_IMPORT, path);
+    // discard the top level result
+    emitByte(OP_POP);
+    if (bind) {
+        defineVariable(global);
+    } else {
+        emitByte(OP_POP);
+    }
+}
+
 static void declaration() {
     if (match(TOKEN_CLASS)) {
         classDeclaration();
@@ -256,6 +312,8 @@ static void declaration() {
         funDeclaration();
     } else if (match(TOKEN_VAR)) {
         varDeclaration();
+    } else if (match(TOKEN_IMPORT)) {
+        importDeclaration();
     } else {
         statement();
     }
@@ -263,9 +321,6 @@ static void declaration() {
     if (parser.panicMode) synchronize();
 }
 
-static uint8_t parseVariable(const char *errorMessage);
-
-
 static void varDeclaration() {
     uint8_t global = parseVariable("Expect variable name.");
 
@@ -339,6 +394,7 @@ static uint8_t parseVariable(const char *errorMessage) {
  * @return
  */
 static uint8_t identifierConstant(Token *name) {
+    if (current->checkOnly) return 0;
     return makeConstant(OBJ_VAL(copyString(name->start,
                                            name->length)));
 }
@@ -373,13 +429,9 @@ static void block() {
 }
 
 /**
- * 编译 时 生成 OP_CLOSURE
- * 运行时 ， 会把指向 ObjClosure的Value push到stack
- * @param type
+ * parameters and body of the current function, starting at '('
  */
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
+static void functionBody() {
     // This beginScope() doesn’t have a corresponding endScope() call. Because we end
     // Compiler completely when we reach the end of the function body, there’s no need
     // to close the lingering outermost scope.
@@ -400,8 +452,66 @@ static void function(FunctionType type) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
+}
 
-    ObjFunction* function = endCompiler();
+/**
+ * lazy first pass: parse the body without generating code, so its errors
+ * are reported at load time, collect its upvalues and remember where to
+ * resume on the first call.
+ */
+static ObjFunction* deferFunction() {
+    ObjFunction* function = current->function;
+    const char* start = parser.current.start;
+    int line = parser.current.line;
+
+    current->checkOnly = true;
+    functionBody();
+    // compileLazy counts the parameters again
+    function->arity = 0;
+
+    if (current->enclosing->checkOnly) {
+        // the body is deferred again when the enclosing one is compiled
+        current = current->enclosing;
+        return function;
+    }
+
+    ObjString** names = ALLOCATE(ObjString*, function->upvalueCount);
+    for (int i = 0; i < function->upvalueCount; i++) names[i] = NULL;
+    LazyBody* lazy = ALLOCATE(LazyBody, 1);
+    lazy->start = start;
+    lazy->end = parser.previous.start + parser.previous.length;
+    lazy->line = line;
+    lazy->type = (uint8_t)current->type;
+    lazy->inClass = currentClass != NULL;
+    lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+    lazy->upvalueNames = names;
+    function->lazy = lazy;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        Token* name = &current->upvalues[i].name;
+        names[i] = copyString(name->start, name->length);
+    }
+
+    current = current->enclosing;
+    rescanFunction(function);
+    return function;
+}
+
+/**
+ * 编译 时 生成 OP_CLOSURE
+ * 运行时 ， 会把指向 ObjClosure的Value push到stack
+ * @param type
+ */
+static void function(FunctionType type) {
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+
+    ObjFunction* function;
+    if (vm.lazyCompile) {
+        function = deferFunction();
+    } else {
+        functionBody();
+        function = endCompiler();
+    }
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
     // variably sized encoding
     for (int i = 0; i < function->upvalueCount; i++) {
@@ -437,6 +547,7 @@ static void endScope() {
 }
 
 static void patchJump(int offset) {
+    if (current->checkOnly) return;
     // -2 to adjust for the bytecode for the jump offset itself.
     int jump = currentChunk()->count - offset - 2;
 
@@ -617,6 +728,7 @@ static void synchronize() {
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
+            case TOKEN_IMPORT:
                 return;
 
             default:; // Do nothing.
@@ -672,23 +784,58 @@ static void consume(TokenType type, const char *message) {
 }
 
 static void emitByte(uint8_t byte) {
+    if (current->checkOnly) return;
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
+// to stderr, or the end of the error log while one is set
+static void reportError(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (errorLog == NULL) {
+        vfprintf(stderr, format, args);
+        va_end(args);
+        return;
+    }
+
+    va_list measure;
+    va_copy(measure, args);
+    int length = vsnprintf(NULL, 0, format, measure);
+    va_end(measure);
+    size_t used = *errorLog == NULL ? 0 : strlen(*errorLog);
+    *errorLog = (char*)realloc(*errorLog, used + length + 1);
+    if (*errorLog == NULL) exit(1);
+    vsnprintf(*errorLog + used, length + 1, format, args);
+    va_end(args);
+}
+
+void logCompileErrors(char** log) {
+    errorLog = log;
+}
+
 static void errorAt(Token *token, const char *message) {
     if (parser.panicMode) return;
     parser.panicMode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
+    LOCK_STREAM(stderr);
+    if (currentModule != NULL && currentModule != vm.mainModule &&
+        currentModule->path != NULL) {
+        // an imported module's error says which file it's in
+        reportError("[%s line %d] Error", currentModule->path->chars,
+                    token->line);
+    } else {
+        reportError("[line %d] Error", token->line);
+    }
 
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        reportError(" at end");
     } else if (token->type == TOKEN_ERROR) {
         // Nothing.
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        reportError(" at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
+    reportError(": %s\n", message);
+    UNLOCK_STREAM(stderr);
     parser.hadError = true;
 }
 
@@ -713,18 +860,33 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
+/**
+ * a finished function is no longer a root. an incremental mark may have
+ * blackened it before the last constants went in without a barrier
+ */
+static void rescanFunction(ObjFunction* function) {
+    if (localHeap == NULL && vm.gcPhase == GC_MARK) {
+        grayObject((Obj*)function);
+    }
+}
+
 static  ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
+        LOCK_STREAM(stdout);
         disassembleChunk(currentChunk(), function->name != NULL
                                          ? function->name->chars : "<script>");
+        UNLOCK_STREAM(stdout);
     }
 #endif
+    // still rooted by the compiler while the block is allocated
+    packChunk(&function->chunk);
     // restoring the previous compiler to be the new current one.
     current = current->enclosing;
+    rescanFunction(function);
     return function;
 }
 
@@ -734,6 +896,7 @@ static  ObjFunction* endCompiler() {
  * @return
  */
 static uint8_t makeConstant(Value value) {
+    if (current->checkOnly) return 0;
     int constant = addConstant(currentChunk(), value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
@@ -869,7 +1032,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 }
 
 static int addUpvalue(Compiler* compiler, uint8_t index,
-                      bool isLocal) {
+                      bool isLocal, Token* name) {
     int upvalueCount = compiler->function->upvalueCount;
 
     //check to see if the function already has an upvalue that closes over that variable.
@@ -887,21 +1050,39 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
+    compiler->upvalues[upvalueCount].name = *name;
     return compiler->function->upvalueCount++;
 }
 
+/**
+ * a lazy body has no enclosing compiler left, its captures were fixed by the
+ * first pass and are found by name
+ */
+static int resolveLazyUpvalue(Compiler* compiler, Token* name) {
+    if (compiler->lazyUpvalues == NULL) return -1;
+
+    for (int i = 0; i < compiler->function->upvalueCount; i++) {
+        ObjString* upvalue = compiler->lazyUpvalues[i];
+        if (upvalue->length == name->length &&
+            memcmp(upvalue->chars, name->start, name->length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 static int resolveUpvalue(Compiler* compiler, Token* name) {
-    if (compiler->enclosing == NULL) return -1;
+    if (compiler->enclosing == NULL) return resolveLazyUpvalue(compiler, name);
 
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, (uint8_t)local, true, name);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, (uint8_t)upvalue, false, name);
     }
 
     return -1;
@@ -1002,6 +1183,36 @@ static void dot(bool canAssign) {
     }
 }
 
+/**
+ * [a, b, c] pushes the elements, OP_BUILD_LIST gathers them
+ */
+static void list(bool canAssign) {
+    uint8_t itemCount = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            if (itemCount == 255) {
+                error("Can't have more than 255 elements in a list literal.");
+            }
+            itemCount++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emitBytes(OP_BUILD_LIST, itemCount);
+}
+
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        emitByte(OP_GET_INDEX);
+    }
+}
+
 static void this_(bool canAssign) {
     if (currentClass == NULL) {
         error("Can't use 'this' outside of a class.");
@@ -1045,6 +1256,8 @@ ParseRule rules[] = {
         [TOKEN_RIGHT_PAREN]   = {NULL, NULL, PREC_NONE},
         [TOKEN_LEFT_BRACE]    = {NULL, NULL, PREC_NONE},
         [TOKEN_RIGHT_BRACE]   = {NULL, NULL, PREC_NONE},
+        [TOKEN_LEFT_BRACKET]  = {list, subscript, PREC_CALL},
+        [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
         [TOKEN_COMMA]         = {NULL, NULL, PREC_NONE},
         [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
         [TOKEN_MINUS]         = {unary, binary, PREC_TERM},
@@ -1070,6 +1283,7 @@ ParseRule rules[] = {
         [TOKEN_FOR]           = {NULL, NULL, PREC_NONE},
         [TOKEN_FUN]           = {NULL, NULL, PREC_NONE},
         [TOKEN_IF]            = {NULL, NULL, PREC_NONE},
+        [TOKEN_IMPORT]        = {NULL, NULL, PREC_NONE},
         [TOKEN_NIL]           = {literal, NULL, PREC_NONE},
         [TOKEN_OR]            = {NULL, or_,    PREC_OR},
         [TOKEN_PRINT]         = {NULL, NULL, PREC_NONE},
@@ -1118,20 +1332,27 @@ static void parsePrecedence(Precedence precedence) {
     }
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type) {
+/**
+ * @param function reuse an existing function object (lazy body), or NULL
+ */
+static void initCompiler(Compiler *compiler, FunctionType type,
+                         ObjFunction* function) {
     // remember enclosing and change current
     compiler->enclosing = current;
 
     compiler->function = NULL;
     compiler->type = type;
-    compiler->function = newFunction();
+    compiler->function = function != NULL ? function : newFunction();
+    compiler->function->module = currentModule;
 
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lazyUpvalues = NULL;
+    compiler->checkOnly = false;
 
     current = compiler;
 
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && current->function->name == NULL) {
         current->function->name = copyString(parser.previous.start,
                                              parser.previous.length);
     }
@@ -1151,12 +1372,58 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     }
 }
 
+bool compileLazy(ObjFunction* function) {
+    // a concurrent mark may be reading the function being filled in
+    lockHeap();
+    LazyBody* lazy = function->lazy;
+    initScannerAt(lazy->start, lazy->end, lazy->line);
+    currentModule = function->module;
+
+    ClassCompiler classCompiler;
+    classCompiler.enclosing = NULL;
+    classCompiler.hasSuperclass = lazy->hasSuperclass;
+    currentClass = lazy->inClass ? &classCompiler : NULL;
+
+    parser.hadError = false;
+    parser.panicMode = false;
+
+    Compiler compiler;
+    initCompiler(&compiler, (FunctionType)lazy->type, function);
+    compiler.lazyUpvalues = lazy->upvalueNames;
+
+    advance();
+    functionBody();
+    endCompiler();
+    currentClass = NULL;
+    currentModule = NULL;
+
+    if (parser.hadError) {
+        // keep the lazy body, the next call reports the error again
+        freeChunk(&function->chunk);
+        function->arity = 0;
+        unlockHeap();
+        return false;
+    }
+    // the captured names may be all that keeps them alive
+    for (int i = 0; i < function->upvalueCount; i++) {
+        shadeValue(OBJ_VAL(lazy->upvalueNames[i]));
+    }
+    freeLazyBody(function);
+    // a function compiled at run time may be old or black, its constants
+    // young or white
+    writeBarrierAll((Obj*)function);
+    unlockHeap();
+    return true;
+}
+
 void markCompilerRoots() {
     Compiler* compiler = current;
     while (compiler != NULL) {
-        markObject((Obj*)compiler->function);
+        // constants are added without a barrier, scan it again each time
+        grayObject((Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
+    markObject((Obj*)currentModule);
 }
 
 static Token syntheticToken(const char* text) {
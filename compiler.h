@@ -6,6 +6,13 @@
 #define clox_compiler_h
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
+ObjFunction* compile(const char* source, ObjModule* module);
+// generate the bytecode of a function deferred by lazy compile mode
+bool compileLazy(ObjFunction* function);
 void markCompilerRoots();
+/**
+ * this thread's compile errors are appended to *log, a malloc'd string the
+ * caller frees, instead of written to stderr. NULL writes them out again
+ */
+void logCompileErrors(char** log);
 #endif
\ No newline at end of file
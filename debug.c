@@ -161,6 +161,14 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_IMPORT:
+            return constantInstruction("OP_IMPORT", chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
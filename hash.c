@@ -0,0 +1,145 @@
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define PRIME1 0x9E3779B185EBCA87ull
+#define PRIME2 0xC2B2AE3D27D4EB4Full
+#define PRIME3 0x165667B19E3779F9ull
+#define PRIME4 0x85EBCA77C2B2AE63ull
+#define PRIME5 0x27D4EB2F165667C5ull
+
+static uint64_t hashSeed = 0;
+
+void setHashSeed(uint64_t seed) {
+    hashSeed = seed;
+}
+
+uint64_t randomHashSeed() {
+    uint64_t seed = 0;
+#ifndef _WIN32
+    int file = open("/dev/urandom", O_RDONLY);
+    if (file >= 0) {
+        ssize_t count = read(file, &seed, sizeof(seed));
+        close(file);
+        if (count == (ssize_t)sizeof(seed)) return seed;
+    }
+#endif
+    seed = (uint64_t)time(NULL) * PRIME1;
+    seed ^= (uint64_t)clock() * PRIME2;
+    seed ^= (uint64_t)(uintptr_t)&seed * PRIME3;
+    return seed;
+}
+
+static inline uint64_t rotate(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// unaligned loads, the compiler makes them one instruction
+static inline uint64_t read64(const char* bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read32(const char* bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hashRound(uint64_t lane, uint64_t input) {
+    lane += input * PRIME2;
+    return rotate(lane, 31) * PRIME1;
+}
+
+static inline uint64_t mergeLane(uint64_t hash, uint64_t lane) {
+    hash ^= hashRound(0, lane);
+    return hash * PRIME1 + PRIME4;
+}
+
+// every input bit reaches the low 32 bits the tables use
+static inline uint32_t avalanche(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return (uint32_t)hash;
+}
+
+/**
+ * names and short strings: two reads that overlap in the middle cover
+ * every byte, with no loop over the tail
+ */
+static uint32_t hashShort(const char* bytes, int length) {
+    uint64_t first = 0;
+    uint64_t last = 0;
+    if (length >= 8) {
+        first = read64(bytes);
+        last = read64(bytes + length - 8);
+    } else if (length >= 4) {
+        first = read32(bytes);
+        last = read32(bytes + length - 4);
+    } else if (length > 0) {
+        first = ((uint64_t)(uint8_t)bytes[0] << 16) |
+                ((uint64_t)(uint8_t)bytes[length / 2] << 8) |
+                (uint8_t)bytes[length - 1];
+    }
+    uint64_t hash = hashSeed + PRIME5 + (uint64_t)length;
+    hash ^= hashRound(0, first);
+    hash = rotate(hash, 27) * PRIME1 + PRIME4;
+    hash ^= hashRound(0, last);
+    hash = rotate(hash, 27) * PRIME1 + PRIME4;
+    return avalanche(hash);
+}
+
+uint32_t hashBytes(const char* bytes, int length) {
+    if (length <= 16) return hashShort(bytes, length);
+
+    const char* end = bytes + length;
+    uint64_t hash;
+    if (length >= 32) {
+        // the lanes don't depend on each other, their rounds overlap
+        uint64_t lane1 = hashSeed + PRIME1 + PRIME2;
+        uint64_t lane2 = hashSeed + PRIME2;
+        uint64_t lane3 = hashSeed;
+        uint64_t lane4 = hashSeed - PRIME1;
+        do {
+            lane1 = hashRound(lane1, read64(bytes));
+            lane2 = hashRound(lane2, read64(bytes + 8));
+            lane3 = hashRound(lane3, read64(bytes + 16));
+            lane4 = hashRound(lane4, read64(bytes + 24));
+            bytes += 32;
+        } while (end - bytes >= 32);
+        hash = rotate(lane1, 1) + rotate(lane2, 7) + rotate(lane3, 12) +
+               rotate(lane4, 18);
+        hash = mergeLane(hash, lane1);
+        hash = mergeLane(hash, lane2);
+        hash = mergeLane(hash, lane3);
+        hash = mergeLane(hash, lane4);
+    } else {
+        hash = hashSeed + PRIME5;
+    }
+    hash += (uint64_t)length;
+
+    for (; end - bytes >= 8; bytes += 8) {
+        hash ^= hashRound(0, read64(bytes));
+        hash = rotate(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (end - bytes >= 4) {
+        hash ^= (uint64_t)read32(bytes) * PRIME1;
+        hash = rotate(hash, 23) * PRIME2 + PRIME3;
+        bytes += 4;
+    }
+    for (; bytes < end; bytes++) {
+        hash ^= (uint8_t)*bytes * PRIME5;
+        hash = rotate(hash, 11) * PRIME1;
+    }
+    return avalanche(hash);
+}
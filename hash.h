@@ -0,0 +1,18 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+/**
+ * string hashes, 8 bytes at a time in four independent lanes (the XXH64
+ * rounds), up to 16 bytes in two overlapping reads. the seed is random per
+ * process, so a script can't pick names that all land in one probe chain;
+ * --hash-seed fixes it for runs that must repeat. set it before the first
+ * string is hashed
+ */
+void setHashSeed(uint64_t seed);
+// from the system's random source, the clock and ASLR without one
+uint64_t randomHashSeed();
+uint32_t hashBytes(const char* bytes, int length);
+
+#endif
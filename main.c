@@ -1,28 +1,191 @@
+#include <ctype.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
+#include "source.h"
+#include "hash.h"
+#include "profiler.h"
 
 static void repl();
 
-static void runFile(const char *path);
+static int runFile(const char *path);
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [--lazy] [--jobs n] [--gc-slice n] "
+                    "[--gc-concurrent] [--gc-compact] [--gc-stats] "
+                    "[--gc-initial-heap size] [--gc-min-heap size] "
+                    "[--gc-max-heap size] [--gc-grow factor] "
+                    "[--gc-target fraction] [--heap-profile file] "
+                    "[--hash-seed n] [path | -]\n");
+    exit(64);
+}
+
+// a byte count, K, M or G multiply it
+static bool parseSize(const char* text, size_t* size) {
+    char* end;
+    if (!isdigit((unsigned char)*text)) return false;
+    unsigned long long value = strtoull(text, &end, 10);
+    int shift = 0;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0' || value > (SIZE_MAX >> shift)) return false;
+    *size = (size_t)value << shift;
+    return true;
+}
+
+static bool parseNumber(const char* text, double min, double max,
+                        double* number) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || !isfinite(value) ||
+        value < min || value > max) {
+        return false;
+    }
+    *number = value;
+    return true;
+}
+
+static const char* gcParameters[] = {
+    "initial-heap", "min-heap", "max-heap", "grow", "target",
+};
+
+/**
+ * a heap sizing parameter, from --gc-<name> or CLOX_GC_<NAME>. false if
+ * there's no such parameter or the value is out of range
+ */
+static bool setGCParameter(const char* name, const char* value) {
+    double number;
+    if (strcmp(name, "initial-heap") == 0) {
+        return parseSize(value, &vm.nextGC);
+    } else if (strcmp(name, "min-heap") == 0) {
+        return parseSize(value, &vm.gcMinHeap);
+    } else if (strcmp(name, "max-heap") == 0) {
+        return parseSize(value, &vm.gcMaxHeap);
+    } else if (strcmp(name, "grow") == 0) {
+        // the live heap times 1 would collect at every allocation
+        if (!parseNumber(value, 1.01, 1000, &number)) return false;
+        vm.gcGrowFactor = number;
+        return true;
+    } else if (strcmp(name, "target") == 0) {
+        if (!parseNumber(value, 0, 0.99, &number)) return false;
+        vm.gcTargetFraction = number;
+        return true;
+    }
+    return false;
+}
+
+// the command line overrides the environment
+static void readGCEnvironment() {
+    for (size_t i = 0; i < sizeof(gcParameters) / sizeof(gcParameters[0]);
+         i++) {
+        char variable[32] = "CLOX_GC_";
+        size_t length = strlen(variable);
+        for (const char* c = gcParameters[i]; *c != '\0'; c++) {
+            variable[length++] = *c == '-' ? '_' : (char)toupper(*c);
+        }
+        variable[length] = '\0';
+
+        const char* value = getenv(variable);
+        if (value != NULL && !setGCParameter(gcParameters[i], value)) {
+            fprintf(stderr, "Invalid %s '%s'.\n", variable, value);
+            exit(64);
+        }
+    }
+}
+
+/**
+ * --hash-seed n, the same string hashes every run. it's read before the
+ * other options, initVM hashes the first strings
+ */
+static void seedHashes(int argc, const char* argv[]) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--hash-seed") != 0) continue;
+        char* end;
+        unsigned long long seed = strtoull(argv[i + 1], &end, 0);
+        if (!isdigit((unsigned char)argv[i + 1][0]) || *end != '\0') {
+            usage();
+        }
+        setHashSeed((uint64_t)seed);
+        return;
+    }
+    setHashSeed(randomHashSeed());
+}
 
 int main(int argc, const char *argv[]) {
+    seedHashes(argc, argv);
     initVM();
+    readGCEnvironment();
+
+    const char* path = NULL;
+    const char* snapshotPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--lazy") == 0) {
+            vm.lazyCompile = true;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            // compile the script and its imports on n threads up front
+            char* end;
+            long jobs = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || jobs < 1 || jobs > 256) usage();
+            vm.compileThreads = (int)jobs;
+        } else if (strcmp(argv[i], "--gc-slice") == 0 && i + 1 < argc) {
+            // collect incrementally, n objects traced or swept per slice
+            char* end;
+            long budget = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || budget < 0 || budget > INT32_MAX) usage();
+            vm.gcSliceBudget = (int)budget;
+        } else if (strcmp(argv[i], "--gc-concurrent") == 0) {
+            // mark on a helper thread while the script runs
+            vm.gcConcurrent = true;
+        } else if (strcmp(argv[i], "--gc-compact") == 0) {
+            // give fragmented pages back by moving what's left in them
+            vm.gcCompact = true;
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            vm.gcStats = true;
+        } else if (strcmp(argv[i], "--hash-seed") == 0 && i + 1 < argc) {
+            // read by seedHashes
+            i++;
+        } else if (strcmp(argv[i], "--heap-profile") == 0 && i + 1 < argc) {
+            // allocation sites, and a heap snapshot at exit
+            vm.heapProfile = true;
+            snapshotPath = argv[++i];
+        } else if (strncmp(argv[i], "--gc-", 5) == 0 && i + 1 < argc &&
+                   setGCParameter(argv[i] + 5, argv[i + 1])) {
+            // heap sizing, see setGCParameter
+            i++;
+        } else if ((argv[i][0] != '-' || strcmp(argv[i], "-") == 0) &&
+                   path == NULL) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    if (vm.gcMaxHeap > 0 && vm.gcMinHeap > vm.gcMaxHeap) usage();
 
-    if (argc == 1) {
+    int status = 0;
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        status = runFile(path);
     }
 
+    if (vm.gcStats) printGCStats();
+    if (snapshotPath != NULL && !writeHeapSnapshot(snapshotPath)) {
+        fprintf(stderr, "Could not write heap snapshot \"%s\".\n",
+                snapshotPath);
+        if (status == 0) status = 74;
+    }
     freeVM();
-    return 0;
+    return status;
 }
 
 static void repl() {
@@ -39,41 +202,12 @@ static void repl() {
     }
 }
 
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
-    }
+static int runFile(const char *path) {
+    Source source;
+    if (!readSource(&source, path)) exit(74);
+    InterpretResult result = interpretSource(source, path);
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
-    }
-
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
-    }
-
-    buffer[bytesRead] = '\0';
-
-    fclose(file);
-    return buffer;
-}
-
-
-static void runFile(const char *path) {
-    char *source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
-
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
 }
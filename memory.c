@@ -1,91 +1,332 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#endif
 
 #include "memory.h"
+#include "slab.h"
 #include "vm.h"
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 #include "compiler.h"
+#include "profiler.h"
 
 static void freeObject(Obj* object);
+static size_t objectSize(Obj* object);
+static void pushGray(Obj* object);
 static void markArray(ValueArray* array);
-#define GC_HEAP_GROW_FACTOR 2
+static void collectOld();
+static void stopMarker();
+#ifdef DEBUG_STRESS_GC
+static void stressGC();
+#endif
+// a running cycle is finished at once when the heap passes this multiple of
+// the threshold that started it
+#define GC_OUTGROWN_FACTOR 2
+// an incremental collection does a slice of work per this much allocation
+#define GC_SLICE_BYTES (64 * 1024)
+// objects swept per slice of a lazy sweep, unless --gc-slice says otherwise
+#define SWEEP_BUDGET 4096
+// work the marker thread does each time it holds the heap lock
+#define MARK_BATCH 256
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+// bigger objects, long strings mostly, are allocated old. copying them out
+// of the nursery costs more than it saves
+#define NURSERY_MAX_OBJECT SLAB_SMALL_BLOCK
+#ifndef DEBUG_STRESS_GC
+// compact once this much of the slab pages is holes, emptying the pages
+// whose blocks are mostly gone
+#define COMPACT_FRAGMENTATION 0.5
+#define COMPACT_OCCUPANCY 0.5
+#else
+// after every cycle, out of every page with room
+#define COMPACT_FRAGMENTATION 0
+#define COMPACT_OCCUPANCY 1
+#endif
+// a slice shorter than this fraction of its parent is copied out when
+// the parent is otherwise garbage
+#define SLICE_COPY_FRACTION 4
+// gray objects popped ahead of blackenObject while their lines load
+#define PREFETCH_DEPTH 4
+
+#if defined(__GNUC__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address) ((void)(address))
+#endif
+
+THREAD_LOCAL LocalHeap* localHeap = NULL;
+// objects of a local heap are half moved over, don't collect
+static bool publishing = false;
+// tables are rehashed at the end of a cycle, don't start the next one
+static bool shrinking = false;
+// a bit per NURSERY_ALIGN bytes of the nursery, clear where it's unused
+static MarkWord nurseryMarks[NURSERY_SIZE / 8 / 64];
+#ifndef _WIN32
+// compile workers share the slabs, the main thread allocates while they idle
+static pthread_mutex_t slabLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+// survivors of the cycle being swept, by type
+static GCCensus census[OBJ_TYPE_COUNT];
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
-    if (newSize > oldSize) {
+    if (localHeap != NULL) {
+        localHeap->bytesAllocated += newSize - oldSize;
+    } else {
+        vm.bytesAllocated += newSize - oldSize;
+        if (newSize > oldSize) {
+            vm.gcTelemetry.oldAllocated += newSize - oldSize;
+        } else {
+            vm.gcTelemetry.freed += oldSize - newSize;
+        }
+    }
+    if (newSize > oldSize && localHeap == NULL && !publishing &&
+        !shrinking) {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+        stressGC();
 #endif
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
-        }
+        collectOld();
     }
+
+#ifndef _WIN32
+    if (localHeap != NULL) pthread_mutex_lock(&slabLock);
+#endif
+    void* result = NULL;
     if (newSize == 0) {
-        free(pointer);
-        return NULL;
+        slabFree(pointer, oldSize);
+    } else {
+        result = slabResize(pointer, oldSize, newSize);
     }
-
-    void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
+#ifndef _WIN32
+    if (localHeap != NULL) pthread_mutex_unlock(&slabLock);
+#endif
     return result;
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+void initLocalHeap(LocalHeap* heap) {
+    heap->objects = NULL;
+    initTable(&heap->strings);
+    heap->bytesAllocated = 0;
+}
+
+/**
+ * the VM's copy of a local string, or the string itself
+ */
+static ObjString* internedString(LocalHeap* heap, ObjString* string) {
+    Value interned;
+    if (string != NULL && tableGet(&heap->strings, string, &interned) &&
+        !IS_NIL(interned)) {
+        return AS_STRING(interned);
+    }
+    return string;
+}
+
+void publishHeap(LocalHeap* heap) {
+    publishing = true;
+    vm.bytesAllocated += heap->bytesAllocated;
+    vm.gcTelemetry.oldAllocated += heap->bytesAllocated;
+
+    // a local string's value is its interned copy, if the VM already has one
+    for (int i = 0; i < heap->strings.capacity; i++) {
+        Entry* entry = &heap->strings.entries[i];
+        if (entry->key == NULL) continue;
+        ObjString* interned = tableFindString(&vm.strings, entry->key->chars,
+                                              entry->key->length,
+                                              entry->key->hash);
+        if (interned != NULL) {
+            entry->value = OBJ_VAL(interned);
+            shadeValue(entry->value);
+        }
+    }
+
+    // compiling only creates strings and functions that point to them
+    for (Obj* object = heap->objects; object != NULL;
+         object = objectNext(object)) {
+        if (object->type != OBJ_FUNCTION) continue;
+        ObjFunction* function = (ObjFunction*)object;
+        function->name = internedString(heap, function->name);
+        ValueArray* constants = &function->chunk.constants;
+        for (int i = 0; i < constants->count; i++) {
+            if (!IS_STRING(constants->values[i])) continue;
+            constants->values[i] = OBJ_VAL(
+                    internedString(heap, AS_STRING(constants->values[i])));
+        }
+        if (function->lazy != NULL) {
+            for (int i = 0; i < function->upvalueCount; i++) {
+                function->lazy->upvalueNames[i] = internedString(
+                        heap, function->lazy->upvalueNames[i]);
+            }
+        }
+    }
+
+    Obj* object = heap->objects;
+    while (object != NULL) {
+        Obj* next = objectNext(object);
+        if (object->type == OBJ_STRING &&
+            internedString(heap, (ObjString*)object) != (ObjString*)object) {
+            freeObject(object);
+        } else {
+            setObjectNext(object, vm.objects);
+            vm.objects = object;
+            // its constants may be young strings the VM interned
+            if (object->type == OBJ_FUNCTION) rememberObject(object);
+            setMarked(object, vm.gcPhase == GC_CONCURRENT);
+        }
+        object = next;
+    }
+
+    for (int i = 0; i < heap->strings.capacity; i++) {
+        Entry* entry = &heap->strings.entries[i];
+        if (entry->key != NULL && IS_NIL(entry->value)) {
+            tableSet(&vm.strings, entry->key, NIL_VAL);
+        }
+    }
+    freeTable(&heap->strings);
+    heap->objects = NULL;
+    heap->bytesAllocated = 0;
+    publishing = false;
+}
+
+static void freeList(Obj* object) {
     while (object != NULL) {
-        Obj* next = object->next;
+        Obj* next = objectNext(object);
         freeObject(object);
         object = next;
     }
+}
+
+void freeObjects() {
+    stopMarker();
+    freeList(vm.objects);
+    freeList(vm.sweepList);
+    Obj* object;
+
+    uint8_t* cursor = vm.nursery;
+    while (cursor < vm.nurseryTop) {
+        object = (Obj*)cursor;
+        cursor += NURSERY_ALIGN(objectSize(object));
+        if (!(object->flags & OBJ_FORWARDED)) freeObject(object);
+    }
+    free(vm.nursery);
+    vm.nursery = NULL;
+    vm.nurseryTop = NULL;
+    vm.nurseryEnd = NULL;
 
+    free(vm.remembered);
     free(vm.grayStack);
+    free(vm.slices);
+    free(vm.gcPauses);
+    freeSlabs();
 }
 
+// strings and closures carry their bytes and upvalues after the header
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) +
+                   sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE: return sizeof(ObjInstance);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_STRING:
+            return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+        case OBJ_MODULE: return sizeof(ObjModule);
+        case OBJ_ROPE: return sizeof(ObjRope);
+        case OBJ_SLICE: return sizeof(ObjSlice);
+        case OBJ_LIST: return sizeof(ObjList);
+    }
+    return 0;
+}
+
+size_t objectFootprint(Obj* object) {
+    size_t size = objectSize(object);
+    switch (object->type) {
+        case OBJ_INSTANCE:
+            return size + tableBytes(((ObjInstance*)object)->fields.capacity);
+        case OBJ_CLASS:
+            return size + tableBytes(((ObjClass*)object)->methods.capacity);
+        case OBJ_MODULE:
+            return size + tableBytes(((ObjModule*)object)->globals.capacity);
+        case OBJ_LIST:
+            return size +
+                   sizeof(Value) * ((ObjList*)object)->items.capacity;
+        case OBJ_FUNCTION: {
+            Chunk* chunk = &((ObjFunction*)object)->chunk;
+            return size + (sizeof(uint8_t) + sizeof(int)) * chunk->capacity +
+                   sizeof(Value) * chunk->constants.capacity;
+        }
+        case OBJ_STRING:
+        case OBJ_CLOSURE:
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE:
+        case OBJ_ROPE:
+        case OBJ_SLICE:
+            break;
+    }
+    return size;
+}
+
+static void countSurvivor(Obj* object) {
+    GCCensus* entry = &census[object->type];
+    entry->objects++;
+    entry->bytes += objectFootprint(object);
+}
+
+/**
+ * free what the object owns, then the object itself unless it's in the
+ * nursery, which is reset as a whole
+ */
 static void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
+    if (vm.heapProfile) profileFree(object);
     switch (object->type) {
-        case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
+        case OBJ_INSTANCE:
+            freeTable(&((ObjInstance*)object)->fields);
             break;
-        case OBJ_INSTANCE: {
-            ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+        case OBJ_CLASS:
+            freeTable(&((ObjClass*)object)->methods);
             break;
-        }
-        case OBJ_CLASS: {
-            ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
-            break;
-        }
-        case OBJ_STRING: {
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
-            break;
-        }
-        case OBJ_CLOSURE: {
-            ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues,
-                       closure->upvalueCount);
-            FREE(ObjClosure, object);
-            break;
-        }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            freeLazyBody(function);
             break;
         }
+        case OBJ_MODULE:
+            freeTable(&((ObjModule*)object)->globals);
+            free(((ObjModule*)object)->compileErrors);
+            break;
+        case OBJ_LIST:
+            freeValueArray(&((ObjList*)object)->items);
+            break;
+        case OBJ_STRING:
+        case OBJ_CLOSURE:
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+        case OBJ_ROPE:
+        case OBJ_SLICE:
             break;
     }
+
+    if (IS_YOUNG(object)) {
+        object->flags |= OBJ_FORWARDED;
+        setObjectNext(object, NULL);
+    } else {
+        reallocate(object, objectSize(object), 0);
+    }
 }
 
 /**
@@ -97,8 +338,10 @@ static void markRoots() {
         markValue(*slot);
     }
 
-    // vm.globals
+    // vm.globals, and every loaded module
     markTable(&vm.globals);
+    markTable(&vm.modules);
+    markObject((Obj*)vm.mainModule);
 
     // vm call frames
     for (int i = 0; i < vm.frameCount; i++) {
@@ -115,7 +358,50 @@ static void markRoots() {
     markObject((Obj*)vm.initString);
 }
 
-static void blackenObject(Obj* object) {
+static void deferSlice(ObjSlice* slice) {
+    if (vm.sliceCapacity < vm.sliceCount + 1) {
+        vm.sliceCapacity = GROW_CAPACITY(vm.sliceCapacity);
+        vm.slices = (ObjSlice**)realloc(
+                vm.slices, sizeof(ObjSlice*) * vm.sliceCapacity);
+        if (vm.slices == NULL) exit(1);
+    }
+    vm.slices[vm.sliceCount++] = slice;
+}
+
+/**
+ * once marking is done: a deferred slice whose parent nothing else reached
+ * gets a string of its own with just its bytes, and the parent is freed.
+ * the copy is allocated marked, the cycle keeps it
+ */
+static void settleSlices() {
+    for (int i = 0; i < vm.sliceCount; i++) {
+        ObjSlice* slice = vm.slices[i];
+        if (isMarked((Obj*)slice->parent)) continue;
+
+        size_t size = sizeof(ObjString) + (size_t)slice->length + 1;
+        ObjString* copy = (ObjString*)slabAllocate(size);
+        copy->obj.type = OBJ_STRING;
+        copy->obj.flags = 0;
+        copy->length = slice->length;
+        copy->hash = 0;
+        memcpy(copy->chars, sliceChars(slice), slice->length);
+        copy->chars[slice->length] = '\0';
+        setMarked((Obj*)copy, true);
+        setObjectNext((Obj*)copy, vm.objects);
+        vm.objects = (Obj*)copy;
+        vm.bytesAllocated += size;
+        vm.gcTelemetry.oldAllocated += size;
+
+        slice->parent = copy;
+        slice->start = 0;
+    }
+    vm.sliceCount = 0;
+}
+
+/**
+ * mark what the object points to, returns the references visited
+ */
+static size_t blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -127,19 +413,19 @@ static void blackenObject(Obj* object) {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
             markValue(bound->receiver);
             markObject((Obj*)bound->method);
-            break;
+            return 2;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
             markTable(&instance->fields);
-            break;
+            return 1 + instance->fields.capacity;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
-            break;
+            return 1 + klass->methods.capacity;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
@@ -147,65 +433,449 @@ static void blackenObject(Obj* object) {
             for (int i = 0; i < closure->upvalueCount; i++) {
                 markObject((Obj*)closure->upvalues[i]);
             }
-            break;
+            return 1 + closure->upvalueCount;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
+            markObject((Obj*)function->module);
             markArray(&function->chunk.constants);
-            break;
+            if (function->lazy != NULL) {
+                for (int i = 0; i < function->upvalueCount; i++) {
+                    markObject((Obj*)function->lazy->upvalueNames[i]);
+                }
+            }
+            return 2 + function->chunk.constants.count;
         }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed);
-            break;
+            return 1;
+        case OBJ_MODULE: {
+            ObjModule* module = (ObjModule*)object;
+            markObject((Obj*)module->path);
+            markTable(&module->globals);
+            markObject((Obj*)module->function);
+            return 2 + module->globals.capacity;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*)rope->flat);
+            return 3;
+        }
+        case OBJ_SLICE: {
+            ObjSlice* slice = (ObjSlice*)object;
+            if (!isMarked((Obj*)slice->parent) &&
+                slice->length <
+                        slice->parent->length / SLICE_COPY_FRACTION) {
+                // maybe the only thing keeping the parent, see settleSlices
+                deferSlice(slice);
+            } else {
+                markObject((Obj*)slice->parent);
+            }
+            return 1;
+        }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*)object;
+            markArray(&list->items);
+            return 1 + list->items.count;
+        }
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
     }
+    return 1;
 }
 
-static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+/**
+ * blacken gray objects until the budget is spent, true once none are left
+ */
+static bool traceReferences(size_t budget) {
+    // a ring of popped objects, the oldest is blackened
+    Obj* ahead[PREFETCH_DEPTH];
+    unsigned int in = 0;
+    unsigned int out = 0;
+    size_t work = 0;
+    while (work < budget) {
+        if (vm.grayCount > 0 && in - out < PREFETCH_DEPTH) {
+            Obj* next = vm.grayStack[--vm.grayCount];
+            PREFETCH(next);
+            ahead[in++ % PREFETCH_DEPTH] = next;
+            continue;
+        }
+        if (in == out) break;
+        work += blackenObject(ahead[out++ % PREFETCH_DEPTH]);
     }
+
+    // out of budget, they're gray still
+    while (in != out) {
+        grayObject(ahead[--in % PREFETCH_DEPTH]);
+    }
+    return vm.grayCount == 0;
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+// the object after the last survivor of the sweep
+static void linkSwept(Obj* object) {
+    if (vm.sweepTail == NULL) {
+        vm.sweepList = object;
+    } else {
+        setObjectNext(vm.sweepTail, object);
+    }
+}
+
+/**
+ * free unmarked objects of the sweep list until the budget is spent, true
+ * once it's done. survivors aren't written to, only the bitmaps are
+ */
+static bool sweep(size_t budget) {
+    size_t work = 0;
+    Obj* object = vm.sweepTail == NULL ? vm.sweepList
+                                       : objectNext(vm.sweepTail);
+    while (object != NULL && work < budget) {
+        Obj* next = objectNext(object);
+        if (isMarked(object)) {
+            setMarked(object, false);
+            countSurvivor(object);
+            vm.sweepTail = object;
         } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
+            linkSwept(next);
+            freeObject(object);
+        }
+        object = next;
+        work++;
+    }
+    if (object != NULL) return false;
+
+    // objects allocated meanwhile go after the survivors
+    linkSwept(vm.objects);
+    vm.objects = vm.sweepList;
+    vm.sweepList = NULL;
+    vm.sweepTail = NULL;
+    return true;
+}
+
+/**
+ * a full GC frees unreached nursery objects in place, their space is reused
+ * once the next minor GC resets the nursery
+ */
+static void sweepNursery() {
+    uint8_t* cursor = vm.nursery;
+    while (cursor < vm.nurseryTop) {
+        Obj* object = (Obj*)cursor;
+        cursor += NURSERY_ALIGN(objectSize(object));
+        if (object->flags & OBJ_FORWARDED) continue;
+        if (isMarked(object)) {
+            setMarked(object, false);
+            countSurvivor(object);
+        } else {
+            freeObject(object);
+        }
+    }
+}
 
-            freeObject(unreached);
+/**
+ * remembered objects the full GC is about to free leave the set
+ */
+static void sweepRemembered() {
+    int count = 0;
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        if (isMarked(vm.remembered[i])) {
+            vm.remembered[count++] = vm.remembered[i];
         }
     }
+    vm.rememberedCount = count;
 }
 
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+#ifndef _WIN32
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markerWake = PTHREAD_COND_INITIALIZER;
+static pthread_t marker;
+static bool markerStarted = false;
+// guarded by heapLock
+static bool marking = false;
+static bool markerStopping = false;
+static double markerTime = 0;
+// stores waiting for the lock, the marker steps aside for them
+static atomic_int heapWaiters = 0;
+#endif
+// mutator only, lockHeap nests
+static int heapLockDepth = 0;
+
+static double pauseStart;
+static int pauseDepth = 0;
+// time this thread spent on the running cycle, for --gc-target. when and
+// how much was allocated as the last one finished
+static double cycleTime = 0;
+static double workStart;
+static int workDepth = 0;
+static double lastCycleEnd = 0;
+static size_t lastCycleAllocated = 0;
+#ifndef _WIN32
+static double lastMarkerTime = 0;
 #endif
 
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// nested collections (a minor GC starting a full one) are one pause
+static void beginPause() {
+    if (pauseDepth++ == 0) pauseStart = now();
+}
+
+static void countPause(double pause) {
+    GCTelemetry* telemetry = &vm.gcTelemetry;
+    telemetry->pauses++;
+    telemetry->pauseTotal += pause;
+    if (pause > telemetry->pauseMax) telemetry->pauseMax = pause;
+    int bucket = 0;
+    for (double limit = 1e-6; pause >= limit && bucket < GC_PAUSE_BUCKETS - 1;
+         limit *= 2) {
+        bucket++;
+    }
+    telemetry->pauseHistogram[bucket]++;
+}
+
+static void endPause() {
+    if (--pauseDepth > 0) return;
+    double pause = now() - pauseStart;
+    countPause(pause);
+    if (!vm.gcStats) return;
+    if (vm.gcPauseCapacity < vm.gcPauseCount + 1) {
+        vm.gcPauseCapacity = GROW_CAPACITY(vm.gcPauseCapacity);
+        vm.gcPauses = (double*)realloc(vm.gcPauses,
+                                       sizeof(double) * vm.gcPauseCapacity);
+        if (vm.gcPauses == NULL) exit(1);
+    }
+    vm.gcPauses[vm.gcPauseCount++] = pause;
+}
+
+// work on the old generation, a minor GC isn't part of a cycle's cost
+static void beginWork() {
+    if (workDepth++ == 0 && vm.gcTargetFraction > 0) workStart = now();
+}
+
+static void endWork() {
+    if (--workDepth > 0 || vm.gcTargetFraction <= 0) return;
+    cycleTime += now() - workStart;
+}
+
+void lockHeap() {
+    if (heapLockDepth == 0 && vm.gcPhase != GC_CONCURRENT) return;
+    if (heapLockDepth++ > 0) return;
+#ifndef _WIN32
+    atomic_fetch_add(&heapWaiters, 1);
+    pthread_mutex_lock(&heapLock);
+    atomic_fetch_sub(&heapWaiters, 1);
+#endif
+}
+
+void unlockHeap() {
+    if (heapLockDepth == 0 || --heapLockDepth > 0) return;
+#ifndef _WIN32
+    pthread_mutex_unlock(&heapLock);
+#endif
+}
+
+void shadeValue(Value value) {
+    if (vm.gcPhase != GC_CONCURRENT || !IS_OBJ(value)) return;
+    lockHeap();
+    markObject(AS_OBJ(value));
+#ifndef _WIN32
+    pthread_cond_signal(&markerWake);
+#endif
+    unlockHeap();
+}
+
+#ifndef _WIN32
+/**
+ * the helper thread. it blackens gray objects a batch at a time while
+ * the mutator runs, holding the heap lock for each batch
+ */
+static void* markerMain(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&heapLock);
+    for (;;) {
+        while (!markerStopping && !(marking && vm.grayCount > 0)) {
+            pthread_cond_wait(&markerWake, &heapLock);
+        }
+        if (markerStopping) break;
+
+        double start = now();
+        traceReferences(MARK_BATCH);
+        markerTime += now() - start;
+
+        pthread_mutex_unlock(&heapLock);
+        while (atomic_load(&heapWaiters) > 0) sched_yield();
+        pthread_mutex_lock(&heapLock);
+    }
+    pthread_mutex_unlock(&heapLock);
+    return NULL;
+}
+#endif
+
+static bool startMarker() {
+#ifndef _WIN32
+    if (!markerStarted) {
+        markerStarted = pthread_create(&marker, NULL, markerMain, NULL) == 0;
+    }
+    return markerStarted;
+#else
+    return false;
+#endif
+}
+
+static void stopMarker() {
+#ifndef _WIN32
+    if (!markerStarted) return;
+    pthread_mutex_lock(&heapLock);
+    markerStopping = true;
+    pthread_cond_signal(&markerWake);
+    pthread_mutex_unlock(&heapLock);
+    pthread_join(marker, NULL);
+    markerStarted = false;
+    markerStopping = false;
+#endif
+}
+
+// the mutator takes the marking over, with the heap locked
+static void markerDone() {
+#ifndef _WIN32
+    marking = false;
+#endif
+}
+
+static void startCycle() {
+    markRoots();
+    vm.gcPhase = GC_MARK;
+}
+
+/**
+ * the end of marking stops the world: roots changed since they were first
+ * marked, after them everything the program can reach is black
+ */
+static void finishMarking() {
     markRoots();
-    traceReferences();
+    traceReferences(SIZE_MAX);
+    settleSlices();
     tableRemoveWhite(&vm.strings);
+    sweepRemembered();
+    memset(census, 0, sizeof(census));
+    sweepNursery();
+
+    // objects allocated from now on go to a fresh list, this cycle keeps them
+    vm.sweepList = vm.objects;
+    vm.sweepTail = NULL;
+    vm.objects = NULL;
+    vm.gcPhase = GC_SWEEP;
+}
+
+/**
+ * the threshold for the next cycle. with a target fraction the program may
+ * allocate, at the rate it did, for as long as the collector's share of the
+ * time stays at the target if the next cycle costs what this one did
+ */
+static size_t nextThreshold() {
+    double live = (double)vm.bytesAllocated;
+    double next = live * vm.gcGrowFactor;
+
+    double time = now();
+    // the pause finishing the cycle so far
+    if (workDepth > 0 && vm.gcTargetFraction > 0) {
+        cycleTime += time - workStart;
+        workStart = time;
+    }
+    double cost = cycleTime;
+#ifndef _WIN32
+    // a lazy compile may hold the heap lock already
+    lockHeap();
+    cost += markerTime - lastMarkerTime;
+    lastMarkerTime = markerTime;
+    unlockHeap();
+#endif
+    // the first cycle has no earlier one to measure the rate from
+    if (vm.gcTargetFraction > 0 && lastCycleEnd > 0 && cost > 0) {
+        double running = time - lastCycleEnd - cycleTime;
+        if (running < 1e-6) running = 1e-6;
+        double rate =
+            (double)(vm.gcTelemetry.oldAllocated - lastCycleAllocated) /
+            running;
+        double fraction = vm.gcTargetFraction;
+        next = live + rate * cost * (1 - fraction) / fraction;
+        if (next < live + live / 8) next = live + live / 8;
+    }
+    cycleTime = 0;
+    lastCycleEnd = time;
+    lastCycleAllocated = vm.gcTelemetry.oldAllocated;
+
+    if (next < (double)vm.gcMinHeap) next = (double)vm.gcMinHeap;
+    if (vm.gcMaxHeap > 0 && next > (double)vm.gcMaxHeap) {
+        // a live heap near the maximum still leaves a little room
+        next = (double)vm.gcMaxHeap;
+        if (next < live + live / 8) next = live + live / 8;
+    }
+    return next < (double)SIZE_MAX ? (size_t)next : SIZE_MAX;
+}
+
+/**
+ * deletes leave a table at its peak size: the cycle just removed its dead
+ * strings, modules and globals are dropped rarely. no instance field is
+ * ever deleted
+ */
+static void shrinkTables() {
+    shrinking = true;
+    tableShrink(&vm.strings);
+    tableShrink(&vm.globals);
+    tableShrink(&vm.modules);
+    for (int i = 0; i < vm.modules.capacity; i++) {
+        Entry* entry = &vm.modules.entries[i];
+        if (entry->key != NULL && IS_MODULE(entry->value)) {
+            tableShrink(&AS_MODULE(entry->value)->globals);
+        }
+    }
+    shrinking = false;
+}
+
+static void finishCycle() {
+    shrinkTables();
+    vm.nextGC = nextThreshold();
+    vm.gcPhase = GC_IDLE;
+    vm.gcTelemetry.majorCollections++;
+    memcpy(vm.gcTelemetry.census, census, sizeof(census));
+    if (vm.gcCompact && slabFragmentation() >= COMPACT_FRAGMENTATION) {
+        // objects move at an instruction boundary, after a minor GC
+        vm.compactPending = true;
+        vm.nurseryFull = true;
+    }
+}
 
-    sweep();
+void collectGarbage() {
+    beginPause();
+    beginWork();
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    // also finishes a running incremental or concurrent cycle
+    bool sweeping = vm.gcPhase == GC_SWEEP;
+    if (vm.gcPhase == GC_IDLE) startCycle();
+    if (vm.gcPhase == GC_MARK || vm.gcPhase == GC_CONCURRENT) {
+        lockHeap();
+        markerDone();
+        finishMarking();
+        unlockHeap();
+    }
+    if (sweeping) {
+        sweep(SIZE_MAX);
+        finishCycle();
+    } else {
+        // the sweep is left to the program's allocations, a slice at a time
+        vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -213,6 +883,701 @@ void collectGarbage() {
            before - vm.bytesAllocated, before, vm.bytesAllocated,
            vm.nextGC);
 #endif
+    endWork();
+    endPause();
+}
+
+/**
+ * snapshot at the beginning: from here on the helper thread marks what the
+ * roots reach. it runs after a minor GC, no young object is white and no
+ * compiler is half done
+ */
+static void startConcurrentCycle() {
+    if (!startMarker()) {
+        // no threads, collect on this one
+        vm.gcConcurrent = false;
+        collectOld();
+        return;
+    }
+    beginPause();
+    beginWork();
+#ifdef DEBUG_LOG_GC
+    printf("-- gc concurrent mark begin\n");
+#endif
+    vm.gcPhase = GC_CONCURRENT;
+    lockHeap();
+    markRoots();
+#ifndef _WIN32
+    marking = true;
+    pthread_cond_signal(&markerWake);
+#endif
+    unlockHeap();
+    vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+    endWork();
+    endPause();
+}
+
+/**
+ * the final remark, once the helper thread ran out of gray objects: roots
+ * and the objects shaded since are marked on this thread
+ */
+static void remark() {
+    lockHeap();
+    bool done = vm.grayCount == 0;
+    unlockHeap();
+    if (!done) {
+        vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+        return;
+    }
+
+    beginPause();
+    beginWork();
+#ifdef DEBUG_LOG_GC
+    printf("-- gc remark\n");
+#endif
+    lockHeap();
+    markerDone();
+    finishMarking();
+    unlockHeap();
+    vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+    endWork();
+    endPause();
+}
+
+void collectSlice() {
+    // the heap outgrew the cycle, finish it at once
+    if (vm.gcPhase != GC_IDLE &&
+        vm.bytesAllocated > vm.nextGC * GC_OUTGROWN_FACTOR) {
+        collectGarbage();
+        return;
+    }
+
+    beginPause();
+    beginWork();
+#ifdef DEBUG_LOG_GC
+    printf("-- gc slice, phase %d\n", vm.gcPhase);
+#endif
+    size_t budget = (size_t)vm.gcSliceBudget;
+    if (vm.gcPhase == GC_IDLE) {
+        startCycle();
+    } else if (vm.gcPhase == GC_MARK) {
+        if (traceReferences(budget)) finishMarking();
+    } else if (sweep(budget > 0 ? budget : SWEEP_BUDGET)) {
+        finishCycle();
+    }
+    vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+    endWork();
+    endPause();
+}
+
+/**
+ * the old generation grew: start or continue a collection when it's due
+ */
+static void collectOld() {
+    if (vm.gcPhase == GC_CONCURRENT) {
+        if (vm.bytesAllocated > vm.nextGC * GC_OUTGROWN_FACTOR) {
+            // the heap outgrew the helper thread
+            collectGarbage();
+        } else if (vm.bytesAllocated >= vm.nextSlice) {
+            remark();
+        }
+    } else if (vm.gcPhase != GC_IDLE) {
+        if (vm.bytesAllocated >= vm.nextSlice) collectSlice();
+    } else if (vm.bytesAllocated > vm.nextGC) {
+        if (vm.gcConcurrent) {
+            // the cycle starts after the next minor GC
+            vm.nurseryFull = true;
+        } else if (vm.gcSliceBudget > 0) {
+            collectSlice();
+        } else {
+            collectGarbage();
+        }
+    }
+}
+
+#ifdef DEBUG_STRESS_GC
+static void stressGC() {
+    if (vm.gcConcurrent) {
+        if (vm.gcPhase == GC_IDLE) {
+            vm.nurseryFull = true;
+        } else if (vm.gcPhase == GC_CONCURRENT) {
+            remark();
+        } else {
+            collectSlice();
+        }
+    } else if (vm.gcSliceBudget > 0) {
+        collectSlice();
+    } else {
+        collectGarbage();
+    }
+}
+#endif
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static const char* typeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_UPVALUE] = "upvalue",
+    [OBJ_CLASS] = "class",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_BOUND_METHOD] = "boundMethod",
+    [OBJ_MODULE] = "module",
+    [OBJ_ROPE] = "rope",
+    [OBJ_SLICE] = "slice",
+    [OBJ_LIST] = "list",
+};
+
+const char* objectTypeName(ObjType type) {
+    return typeNames[type];
+}
+
+#define MB(bytes) ((double)(bytes) / (1024 * 1024))
+
+static void printPauses() {
+    GCTelemetry* telemetry = &vm.gcTelemetry;
+    fprintf(stderr, "    %zu pauses, %.3f ms total, %.3f ms max\n",
+            telemetry->pauses, telemetry->pauseTotal * 1e3,
+            telemetry->pauseMax * 1e3);
+    double limit = 1e-6;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++, limit *= 2) {
+        size_t count = telemetry->pauseHistogram[i];
+        if (count == 0) continue;
+        if (i < GC_PAUSE_BUCKETS - 1) {
+            fprintf(stderr, "      < %-9g ms %zu\n", limit * 1e3, count);
+        } else {
+            fprintf(stderr, "     >= %-9g ms %zu\n", limit / 2 * 1e3, count);
+        }
+    }
+    if (vm.gcPauseCount == 0) return;
+
+    qsort(vm.gcPauses, vm.gcPauseCount, sizeof(double), compareDoubles);
+    static const int percentiles[] = {50, 90, 99, 100};
+    for (int i = 0; i < 4; i++) {
+        int index = (vm.gcPauseCount - 1) * percentiles[i] / 100;
+        fprintf(stderr, "    p%-3d %.3f ms\n", percentiles[i],
+                vm.gcPauses[index] * 1e3);
+    }
+}
+
+void printGCStats() {
+    lockHeap();
+    GCTelemetry* telemetry = &vm.gcTelemetry;
+    fprintf(stderr, "gc: %zu minor, %zu full collections, %zu compactions\n",
+            telemetry->minorCollections, telemetry->majorCollections,
+            telemetry->compactions);
+    fprintf(stderr, "    allocated %.1f MB young, %.1f MB old (%.1f MB "
+                    "promoted), freed %.1f MB\n",
+            MB(telemetry->youngAllocated), MB(telemetry->oldAllocated),
+            MB(telemetry->promoted), MB(telemetry->freed));
+    // promotions were counted as young allocations already
+    size_t allocated = telemetry->youngAllocated + telemetry->oldAllocated -
+                       telemetry->promoted;
+    fprintf(stderr, "    %.1f MB/s allocated, gray stack high water %d\n",
+            MB(allocated) / (now() - telemetry->start),
+            telemetry->grayHighWater);
+#ifndef _WIN32
+    if (vm.gcConcurrent) {
+        fprintf(stderr, "    %.3f ms marking on the helper thread\n",
+                markerTime * 1e3);
+    }
+#endif
+    printPauses();
+
+    if (telemetry->majorCollections > 0) {
+        fprintf(stderr, "    live after the last full collection:\n");
+        for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+            GCCensus* entry = &telemetry->census[i];
+            if (entry->objects == 0) continue;
+            fprintf(stderr, "      %-12s %9zu objects %12zu bytes\n",
+                    typeNames[i], entry->objects, entry->bytes);
+        }
+    }
+    unlockHeap();
+}
+
+bool gcStatValue(const char* name, double* value) {
+    GCTelemetry* telemetry = &vm.gcTelemetry;
+    const char* dot = strchr(name, '.');
+    if (dot != NULL) {
+        for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+            if (strcmp(dot + 1, typeNames[i]) != 0) continue;
+            GCCensus* entry = &telemetry->census[i];
+            size_t length = (size_t)(dot - name);
+            if (length == 4 && memcmp(name, "live", 4) == 0) {
+                *value = (double)entry->bytes;
+                return true;
+            }
+            if (length == 7 && memcmp(name, "objects", 7) == 0) {
+                *value = (double)entry->objects;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    lockHeap();
+    int grayHighWater = telemetry->grayHighWater;
+    unlockHeap();
+    struct {
+        const char* name;
+        double value;
+    } counters[] = {
+        {"minorCollections", (double)telemetry->minorCollections},
+        {"majorCollections", (double)telemetry->majorCollections},
+        {"compactions", (double)telemetry->compactions},
+        {"pauses", (double)telemetry->pauses},
+        {"pauseTotal", telemetry->pauseTotal},
+        {"pauseMax", telemetry->pauseMax},
+        {"youngAllocated", (double)telemetry->youngAllocated},
+        {"oldAllocated", (double)telemetry->oldAllocated},
+        {"promoted", (double)telemetry->promoted},
+        {"freed", (double)telemetry->freed},
+        {"grayHighWater", (double)grayHighWater},
+        {"heapSize", (double)vm.bytesAllocated},
+        {"nextGC", (double)vm.nextGC},
+        {"stringTableCapacity", (double)vm.strings.capacity},
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        if (strcmp(name, counters[i].name) == 0) {
+            *value = counters[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+void initNursery() {
+    vm.nursery = (uint8_t*)malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL) exit(1);
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryEnd = vm.nursery + NURSERY_SIZE;
+    vm.nurseryFull = false;
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    memset(&vm.gcTelemetry, 0, sizeof(vm.gcTelemetry));
+    vm.gcTelemetry.start = now();
+}
+
+void* allocateYoung(size_t size) {
+    // compile workers allocate into their local heap
+    if (localHeap != NULL || size > NURSERY_MAX_OBJECT) return NULL;
+    size = NURSERY_ALIGN(size);
+    if (size > (size_t)(vm.nurseryEnd - vm.nurseryTop)) {
+        vm.nurseryFull = true;
+        return NULL;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    if (!publishing) stressGC();
+    vm.nurseryFull = true;
+#endif
+    void* object = vm.nurseryTop;
+    vm.nurseryTop += size;
+    vm.gcTelemetry.youngAllocated += size;
+    return object;
+}
+
+void rememberObject(Obj* object) {
+    if ((object->flags & OBJ_REMEMBERED) || IS_YOUNG(object)) return;
+    object->flags |= OBJ_REMEMBERED;
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered,
+                                       sizeof(Obj*) * vm.rememberedCapacity);
+        if (vm.remembered == NULL) exit(1);
+    }
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+// old objects moved by a compaction are forwarded instead
+static bool compacting = false;
+
+/**
+ * a copy in a fresh slab block, a closed upvalue points at its own copy
+ */
+static Obj* copyObject(Obj* object, size_t size) {
+    Obj* copy = (Obj*)slabAllocate(size);
+    memcpy(copy, object, size);
+    if (vm.heapProfile) profileMove(object, copy);
+    if (object->type == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        if (upvalue->location == &upvalue->closed) {
+            ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+        }
+    }
+    return copy;
+}
+
+/**
+ * where a young object lives after the minor GC: survivors are copied to
+ * the old generation once, the copy waits on the gray stack to be scanned
+ */
+static Obj* forwardObject(Obj* object) {
+    if (compacting) {
+        return object != NULL && (object->flags & OBJ_FORWARDED)
+                       ? objectNext(object)
+                       : object;
+    }
+    if (object == NULL || !IS_YOUNG(object)) return object;
+    if (object->flags & OBJ_FORWARDED) return objectNext(object);
+
+    size_t size = objectSize(object);
+    Obj* copy = copyObject(object, size);
+    if (isMarked(object)) setMarked(copy, true);
+    vm.bytesAllocated += size;
+    vm.gcTelemetry.oldAllocated += size;
+    vm.gcTelemetry.promoted += size;
+    setObjectNext(copy, vm.objects);
+    vm.objects = copy;
+
+    object->flags |= OBJ_FORWARDED;
+    setObjectNext(object, copy);
+    pushGray(copy);
+    return copy;
+}
+
+#define FORWARD(type, field) ((field) = (type*)forwardObject((Obj*)(field)))
+
+static void forwardValue(Value* slot) {
+    if (IS_OBJ(*slot)) *slot = OBJ_VAL(forwardObject(AS_OBJ(*slot)));
+}
+
+static void forwardTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        FORWARD(ObjString, entry->key);
+        forwardValue(&entry->value);
+    }
+}
+
+static void forwardReferences(Obj* object) {
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            forwardValue(&bound->receiver);
+            FORWARD(ObjClosure, bound->method);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            FORWARD(ObjClass, instance->klass);
+            forwardTable(&instance->fields);
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            FORWARD(ObjString, klass->name);
+            forwardTable(&klass->methods);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            FORWARD(ObjFunction, closure->function);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                FORWARD(ObjUpvalue, closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            FORWARD(ObjString, function->name);
+            FORWARD(ObjModule, function->module);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                forwardValue(&function->chunk.constants.values[i]);
+            }
+            if (function->lazy != NULL) {
+                for (int i = 0; i < function->upvalueCount; i++) {
+                    FORWARD(ObjString, function->lazy->upvalueNames[i]);
+                }
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            // the open list is a root, a closed upvalue's next is stale
+            forwardValue(&((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_MODULE: {
+            ObjModule* module = (ObjModule*)object;
+            FORWARD(ObjString, module->path);
+            forwardTable(&module->globals);
+            FORWARD(ObjFunction, module->function);
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            FORWARD(Obj, rope->left);
+            FORWARD(Obj, rope->right);
+            FORWARD(ObjString, rope->flat);
+            break;
+        }
+        case OBJ_SLICE:
+            FORWARD(ObjString, ((ObjSlice*)object)->parent);
+            break;
+        case OBJ_LIST: {
+            ValueArray* items = &((ObjList*)object)->items;
+            for (int i = 0; i < items->count; i++) {
+                forwardValue(&items->values[i]);
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+/**
+ * interned strings are weak: promoted ones move in vm.strings, unreached
+ * ones leave it. every other unreached object just frees what it owns.
+ */
+static void sweepPromoted() {
+    uint8_t* cursor = vm.nursery;
+    while (cursor < vm.nurseryTop) {
+        Obj* object = (Obj*)cursor;
+        cursor += NURSERY_ALIGN(objectSize(object));
+        bool interned = object->flags & OBJ_INTERNED;
+        if (object->flags & OBJ_FORWARDED) {
+            if (interned && objectNext(object) != NULL) {
+                tableMoveKey(&vm.strings, (ObjString*)object,
+                             (ObjString*)objectNext(object));
+            }
+            continue;
+        }
+        if (interned) tableDelete(&vm.strings, (ObjString*)object);
+        freeObject(object);
+    }
+}
+
+/**
+ * no compiler runs at an instruction boundary, the VM holds all roots
+ */
+static void forwardRoots() {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        forwardValue(slot);
+    }
+    for (int i = 0; i < vm.frameCount; i++) {
+        FORWARD(ObjClosure, vm.frames[i].closure);
+    }
+    FORWARD(ObjUpvalue, vm.openUpvalues);
+    for (ObjUpvalue* upvalue = vm.openUpvalues;
+         upvalue != NULL;
+         upvalue = upvalue->next) {
+        FORWARD(ObjUpvalue, upvalue->next);
+    }
+    forwardTable(&vm.globals);
+    forwardTable(&vm.modules);
+    FORWARD(ObjModule, vm.mainModule);
+    FORWARD(ObjString, vm.initString);
+}
+
+// frames point into their module's globals, which may have moved
+static void refreshFrames() {
+    for (int i = 0; i < vm.frameCount; i++) {
+        CallFrame* frame = &vm.frames[i];
+        frame->globals = &frame->closure->function->module->globals;
+    }
+}
+
+static void* moveBlock(void* block, size_t size) {
+    if (block == NULL || !slabIsEvacuating(block, size)) return block;
+    void* copy = slabAllocate(size);
+    memcpy(copy, block, size);
+    slabFree(block, size);
+    return copy;
+}
+
+#define MOVE_ARRAY(type, pointer, count) \
+    ((pointer) = (type*)moveBlock((pointer), sizeof(type) * (count)))
+
+// entries and their control bytes are one block
+#define MOVE_TABLE(table) \
+    ((table)->entries = (Entry*)moveBlock((table)->entries, \
+                                          tableBytes((table)->capacity)))
+
+/**
+ * arrays only their object points to. chunk code stays, frames point into
+ * it, and so do the constants of a packed chunk
+ */
+static void moveArrays(Obj* object) {
+    switch (object->type) {
+        case OBJ_INSTANCE: {
+            Table* fields = &((ObjInstance*)object)->fields;
+            MOVE_TABLE(fields);
+            break;
+        }
+        case OBJ_CLASS: {
+            Table* methods = &((ObjClass*)object)->methods;
+            MOVE_TABLE(methods);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            Chunk* chunk = &((ObjFunction*)object)->chunk;
+            if (!chunk->packed) {
+                MOVE_ARRAY(Value, chunk->constants.values,
+                           chunk->constants.capacity);
+            }
+            break;
+        }
+        case OBJ_MODULE: {
+            Table* globals = &((ObjModule*)object)->globals;
+            MOVE_TABLE(globals);
+            break;
+        }
+        case OBJ_LIST: {
+            ValueArray* items = &((ObjList*)object)->items;
+            MOVE_ARRAY(Value, items->values, items->capacity);
+            break;
+        }
+        case OBJ_STRING:
+        case OBJ_CLOSURE:
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE:
+        case OBJ_ROPE:
+        case OBJ_SLICE:
+            break;
+    }
+}
+
+/**
+ * old objects and their arrays leave the slab pages that are mostly holes,
+ * then everything pointing at them is forwarded. runs right after a minor
+ * GC, the nursery is empty and no cycle runs
+ */
+static void compactHeap() {
+    vm.compactPending = false;
+    if (slabBeginEvacuation(COMPACT_OCCUPANCY) == 0) return;
+    beginPause();
+    beginWork();
+    vm.gcTelemetry.compactions++;
+#ifdef DEBUG_LOG_GC
+    printf("-- compact begin\n");
+#endif
+
+    // old copies are freed once nothing points to them
+    Obj** moved = NULL;
+    int movedCount = 0;
+    int movedCapacity = 0;
+    Obj* previous = NULL;
+    for (Obj* object = vm.objects; object != NULL;
+         object = objectNext(object)) {
+        size_t size = objectSize(object);
+        if (slabIsEvacuating(object, size)) {
+            Obj* copy = copyObject(object, size);
+            object->flags |= OBJ_FORWARDED;
+            setObjectNext(object, copy);
+            if (previous == NULL) {
+                vm.objects = copy;
+            } else {
+                setObjectNext(previous, copy);
+            }
+
+            if (movedCapacity < movedCount + 1) {
+                movedCapacity = GROW_CAPACITY(movedCapacity);
+                moved = (Obj**)realloc(moved, sizeof(Obj*) * movedCapacity);
+                if (moved == NULL) exit(1);
+            }
+            moved[movedCount++] = object;
+            object = copy;
+        }
+        previous = object;
+    }
+
+    compacting = true;
+    forwardRoots();
+    // weak, but a full GC just left only reachable strings in it
+    forwardTable(&vm.strings);
+    for (Obj* object = vm.objects; object != NULL;
+         object = objectNext(object)) {
+        forwardReferences(object);
+        moveArrays(object);
+    }
+    compacting = false;
+    refreshFrames();
+    MOVE_TABLE(&vm.strings);
+    MOVE_TABLE(&vm.globals);
+    MOVE_TABLE(&vm.modules);
+
+    for (int i = 0; i < movedCount; i++) {
+        slabFree(moved[i], objectSize(moved[i]));
+    }
+    free(moved);
+    // pages with blocks left take allocations again
+    slabEndEvacuation();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- compact end, moved %d objects\n", movedCount);
+#endif
+    endWork();
+    endPause();
+}
+
+void collectNursery() {
+    beginPause();
+    vm.gcTelemetry.minorCollections++;
+    // objects move, the helper thread waits
+    lockHeap();
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+
+    int grayBase = vm.grayCount;
+    forwardRoots();
+
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->flags &= ~OBJ_REMEMBERED;
+        forwardReferences(vm.remembered[i]);
+    }
+    vm.rememberedCount = 0;
+
+    // copies wait above the gray objects of an incremental mark
+    while (vm.grayCount > grayBase) {
+        forwardReferences(vm.grayStack[--vm.grayCount]);
+    }
+
+    refreshFrames();
+    sweepPromoted();
+    // gray nursery objects moved, or died since they were marked
+    int grayCount = 0;
+    for (int i = 0; i < vm.grayCount; i++) {
+        Obj* object = vm.grayStack[i];
+        if (IS_YOUNG(object)) object = objectNext(object);
+        if (object != NULL) vm.grayStack[grayCount++] = object;
+    }
+    vm.grayCount = grayCount;
+    vm.nurseryTop = vm.nursery;
+    memset(nurseryMarks, 0, sizeof(nurseryMarks));
+    vm.nurseryFull = false;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   promoted %zu bytes, old generation %zu\n",
+           vm.bytesAllocated - before, vm.bytesAllocated);
+#endif
+
+    unlockHeap();
+
+    if (vm.compactPending && vm.gcPhase == GC_IDLE) compactHeap();
+#ifdef DEBUG_STRESS_GC
+    bool due = true;
+#else
+    bool due = vm.bytesAllocated > vm.nextGC;
+#endif
+    if (vm.gcConcurrent && vm.gcPhase == GC_IDLE && due) {
+        startConcurrentCycle();
+    } else {
+        collectOld();
+    }
+    endPause();
 }
 
 void markValue(Value value) {
@@ -225,18 +1590,41 @@ static void markArray(ValueArray* array) {
     }
 }
 
-void markObject(Obj* object) {
-    if (object == NULL) return;
-    if (object->isMarked) return;
+static MarkWord* markWord(Obj* object, uint64_t* bit) {
+    if (IS_YOUNG(object)) {
+        size_t slot = (size_t)((uint8_t*)object - vm.nursery) / 8;
+        *bit = (uint64_t)1 << (slot % 64);
+        return &nurseryMarks[slot / 64];
+    }
+    // old objects all have a slab page, a large one has its own
+    return slabMarkWord(object, bit);
+}
 
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*)object);
-    printValue(OBJ_VAL(object));
-    printf("\n");
-#endif
+bool isMarked(Obj* object) {
+    uint64_t bit;
+    MarkWord* word = markWord(object, &bit);
+    return MARK_TEST(*word, bit);
+}
+
+static void setMarkBit(MarkWord* word, uint64_t bit) {
+    if (vm.gcPhase == GC_CONCURRENT) {
+        MARK_SET_SHARED(*word, bit);
+    } else {
+        MARK_SET(*word, bit);
+    }
+}
 
-    object->isMarked = true;
-    // tracing, add to worklist
+void setMarked(Obj* object, bool marked) {
+    uint64_t bit;
+    MarkWord* word = markWord(object, &bit);
+    if (marked) {
+        setMarkBit(word, bit);
+    } else {
+        MARK_CLEAR(*word, bit);
+    }
+}
+
+static void pushGray(Obj* object) {
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
         vm.grayStack = (Obj**)realloc(vm.grayStack,
@@ -245,5 +1633,35 @@ void markObject(Obj* object) {
     }
 
     vm.grayStack[vm.grayCount++] = object;
+    if (vm.grayCount > vm.gcTelemetry.grayHighWater) {
+        vm.gcTelemetry.grayHighWater = vm.grayCount;
+    }
+}
+
+void markObject(Obj* object) {
+    if (object == NULL) return;
+    uint64_t bit;
+    MarkWord* word = markWord(object, &bit);
+    if (MARK_TEST(*word, bit)) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    setMarkBit(word, bit);
+    pushGray(object);
+}
+
+void writeBarrierAll(Obj* object) {
+    rememberObject(object);
+    // a black object is scanned again
+    if (vm.gcPhase == GC_MARK && isMarked(object)) grayObject(object);
+}
+
+void grayObject(Obj* object) {
+    if (object == NULL) return;
+    setMarked(object, true);
+    pushGray(object);
 }
 
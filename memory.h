@@ -21,12 +21,127 @@
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
+/**
+ * objects allocated by a compile worker thread. they stay out of vm.objects
+ * and vm.strings, and are never collected, until publishHeap hands them over.
+ */
+typedef struct {
+    Obj* objects;
+    // strings interned by this thread only
+    Table strings;
+    size_t bytesAllocated;
+} LocalHeap;
 
+// not NULL while this thread allocates into a local heap
+extern THREAD_LOCAL LocalHeap* localHeap;
+
+void initLocalHeap(LocalHeap* heap);
+// main thread only, strings the VM already interned replace the local copies
+void publishHeap(LocalHeap* heap);
+
+
+// young generation, a minor GC runs when it's full
+#define NURSERY_SIZE (256 * 1024)
+
+#define IS_YOUNG(object) \
+    ((uint8_t*)(object) >= vm.nursery && (uint8_t*)(object) < vm.nurseryEnd)
+
+/**
+ * after storing value into owner. an old object that now points into the
+ * nursery is remembered, so a minor GC can update it when objects move.
+ * while an incremental mark runs the value is shaded, a black owner must
+ * never point to a white object.
+ */
+#define WRITE_BARRIER(owner, value) \
+    do { \
+        if (IS_OBJ(value)) { \
+            if (IS_YOUNG(AS_OBJ(value))) rememberObject((Obj*)(owner)); \
+            if (vm.gcPhase == GC_MARK) markObject(AS_OBJ(value)); \
+        } \
+    } while (false)
+
+void initNursery();
+// bump allocated, NULL when the nursery is full
+void* allocateYoung(size_t size);
+void rememberObject(Obj* object);
+// for stores the barrier doesn't see, the whole object is scanned again
+void writeBarrierAll(Obj* object);
+
+/**
+ * full mark, never moves objects. unreached objects are swept lazily, a
+ * slice for every 64 KB the program allocates. a running cycle, or sweep,
+ * is finished instead.
+ */
 void collectGarbage();
+// a budgeted step of an incremental cycle or a lazy sweep, starting a
+// cycle when idle
+void collectSlice();
+// minor GC, moves survivors out of the nursery: instruction boundaries only
+void collectNursery();
+
+// pauses under 1 us, then a bucket per doubling, the last one open ended
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct {
+    size_t objects;
+    // with the arrays they own
+    size_t bytes;
+} GCCensus;
+
+/**
+ * counters kept whether or not --gc-stats is on. the census is taken as a
+ * full cycle sweeps: the objects its mark reached
+ */
+typedef struct {
+    // since initNursery, for the allocation rate
+    double start;
+    size_t minorCollections;
+    size_t majorCollections;
+    size_t compactions;
+    size_t pauses;
+    double pauseTotal;
+    double pauseMax;
+    size_t pauseHistogram[GC_PAUSE_BUCKETS];
+    // bytes bump allocated in the nursery, and allocated in the old
+    // generation, promotions included
+    size_t youngAllocated;
+    size_t oldAllocated;
+    size_t promoted;
+    size_t freed;
+    int grayHighWater;
+    // by ObjType, as of the last finished cycle
+    GCCensus census[OBJ_TYPE_COUNT];
+} GCTelemetry;
+
+// the object and the arrays it owns
+size_t objectFootprint(Obj* object);
+const char* objectTypeName(ObjType type);
+// telemetry, and with --gc-stats pause percentiles, to stderr
+void printGCStats();
+/**
+ * a counter by name, "live.<type>" and "objects.<type>" are the census.
+ * false if there's none
+ */
+bool gcStatValue(const char* name, double* value);
+
+// the helper thread of a concurrent mark may be reading objects, stores into
+// them hold the heap lock. nests, and does nothing while nothing is marked
+void lockHeap();
+void unlockHeap();
+/**
+ * snapshot at the beginning: a value about to be overwritten, or an interned
+ * string used again, is marked by a concurrent cycle
+ */
+void shadeValue(Value value);
 
 void markValue(Value value);
 
 void markObject(Obj* object);
+// push to the gray stack even if it's marked already
+void grayObject(Obj* object);
+// mark bits live in side bitmaps of the nursery and the slab pages
+bool isMarked(Obj* object);
+void setMarked(Obj* object, bool marked);
 
 void freeObjects();
 #endif
\ No newline at end of file
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "module.h"
+#include "compiler.h"
+#include "memory.h"
+#include "pool.h"
+#include "scanner.h"
+#include "vm.h"
+
+typedef struct {
+    ObjModule* module;
+    // the main script's is given, workers read the others
+    Source source;
+    bool hasSource;
+    // objects compiled on the worker, published by the main thread
+    LocalHeap heap;
+    ObjFunction* function;
+    // its compile errors, kept until the import runs
+    char* errors;
+    // import paths as written, found by scanning the source
+    char** imports;
+    int importCount;
+    int importCapacity;
+} CompileJob;
+
+static CompileJob* newJob(ObjModule* module) {
+    CompileJob* job = (CompileJob*)malloc(sizeof(CompileJob));
+    if (job == NULL) exit(1);
+    job->module = module;
+    job->hasSource = false;
+    initLocalHeap(&job->heap);
+    job->function = NULL;
+    job->errors = NULL;
+    job->imports = NULL;
+    job->importCount = 0;
+    job->importCapacity = 0;
+    return job;
+}
+
+static void freeJob(CompileJob* job) {
+    for (int i = 0; i < job->importCount; i++) {
+        free(job->imports[i]);
+    }
+    free(job->imports);
+    free(job->errors);
+    free(job);
+}
+
+static void addImport(CompileJob* job, const char* path, int length) {
+    if (job->importCapacity < job->importCount + 1) {
+        job->importCapacity = job->importCapacity < 8
+                              ? 8 : job->importCapacity * 2;
+        job->imports = (char**)realloc(job->imports,
+                                       sizeof(char*) * job->importCapacity);
+        if (job->imports == NULL) exit(1);
+    }
+    char* copy = (char*)malloc(length + 1);
+    if (copy == NULL) exit(1);
+    memcpy(copy, path, length);
+    copy[length] = '\0';
+    job->imports[job->importCount++] = copy;
+}
+
+/**
+ * 'import' followed by a string, anywhere in the source. imports that are
+ * never run get compiled too, imports inside lazy bodies are found as well.
+ * the errors of such a module are only reported if its import runs
+ */
+static void scanImports(CompileJob* job) {
+    initScanner(job->source.chars);
+    TokenType previous = TOKEN_EOF;
+    for (;;) {
+        Token token = scanToken();
+        if (token.type == TOKEN_EOF) break;
+        if (previous == TOKEN_IMPORT && token.type == TOKEN_STRING) {
+            // without the quotes
+            addImport(job, token.start + 1, token.length - 2);
+        }
+        previous = token.type;
+    }
+}
+
+/**
+ * runs on a pool thread, touches nothing of the VM but its own local heap
+ */
+static void compileJob(void* arg) {
+    CompileJob* job = (CompileJob*)arg;
+    if (!job->hasSource) {
+        if (!readSource(&job->source, job->module->path->chars)) return;
+        job->hasSource = true;
+    }
+
+    scanImports(job);
+    localHeap = &job->heap;
+    logCompileErrors(&job->errors);
+    job->function = compile(job->source.chars, job->module);
+    logCompileErrors(NULL);
+    localHeap = NULL;
+}
+
+/**
+ * queue the modules a compiled one imports, unless they're known already
+ */
+static void addImportedModules(CompileJob* job, CompileJob*** jobs,
+                               int* count, int* capacity) {
+    ObjString* from = job->module->path;
+    for (int i = 0; i < job->importCount; i++) {
+        char resolved[SOURCE_PATH_MAX];
+        // a missing module is reported if its import runs
+        if (!resolveSourcePath(from == NULL ? NULL : from->chars,
+                               job->imports[i], resolved, sizeof(resolved))) {
+            continue;
+        }
+
+        ObjString* key = copyString(resolved, (int)strlen(resolved));
+        Value cached;
+        if (tableGet(&vm.modules, key, &cached)) continue;
+
+        push(OBJ_VAL(key));
+        ObjModule* module = newModule(key);
+        push(OBJ_VAL(module));
+        tableSet(&vm.modules, key, OBJ_VAL(module));
+        pop();
+        pop();
+
+        if (*capacity < *count + 1) {
+            *capacity = *capacity < 8 ? 8 : *capacity * 2;
+            *jobs = (CompileJob**)realloc(*jobs,
+                                          sizeof(CompileJob*) * *capacity);
+            if (*jobs == NULL) exit(1);
+        }
+        (*jobs)[(*count)++] = newJob(module);
+    }
+}
+
+bool compileModules(ObjModule* main, Source source, int threadCount) {
+    ThreadPool pool;
+    initPool(&pool, threadCount);
+
+    int capacity = 8;
+    int count = 0;
+    CompileJob** jobs = (CompileJob**)malloc(sizeof(CompileJob*) * capacity);
+    if (jobs == NULL) exit(1);
+    jobs[count] = newJob(main);
+    jobs[count]->source = source;
+    jobs[count]->hasSource = true;
+    count++;
+
+    // breadth first over the import graph, a round per level
+    bool compiled = true;
+    int start = 0;
+    while (start < count) {
+        int end = count;
+        runPool(&pool, compileJob, (void**)&jobs[start], end - start);
+
+        for (int i = start; i < end; i++) {
+            CompileJob* job = jobs[i];
+            if (!job->hasSource) {
+                // reported if its import runs
+                tableDelete(&vm.modules, job->module->path);
+                continue;
+            }
+
+            // rooted by the module before its objects join the heap
+            lockHeap();
+            job->module->function = job->function;
+            unlockHeap();
+            writeBarrierAll((Obj*)job->module);
+            publishHeap(&job->heap);
+            if (job->function == NULL && job->module == main) {
+                if (job->errors != NULL) fputs(job->errors, stderr);
+                compiled = false;
+            } else if (job->function == NULL) {
+                // an import that never runs doesn't fail the program
+                job->module->compileErrors = job->errors;
+                job->errors = NULL;
+            }
+            if (job->module != main) releaseSource(job->source);
+
+            addImportedModules(job, &jobs, &count, &capacity);
+        }
+        start = end;
+    }
+
+    for (int i = 0; i < count; i++) {
+        freeJob(jobs[i]);
+    }
+    free(jobs);
+    freePool(&pool);
+    return compiled;
+}
@@ -0,0 +1,16 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+#include "object.h"
+#include "source.h"
+
+/**
+ * compile the main script and every module it imports, transitively, on
+ * threadCount threads before anything runs. each module keeps its top level
+ * function until its first import runs it, the main one is left in
+ * main->function. false if the main script has compile errors, a module's
+ * are kept and reported when its import runs, as a serial run would.
+ */
+bool compileModules(ObjModule* main, Source source, int threadCount);
+
+#endif
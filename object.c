@@ -2,10 +2,13 @@
 // Created by lc on 2022-12-29.
 //
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
 #include "value.h"
 #include "vm.h"
 #include "table.h"
@@ -20,13 +23,30 @@
  * allocate specific Obj struct on heap, assign objType
  */
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = (Obj*)allocateYoung(size);
+    bool young = object != NULL;
+    if (!young) {
+        // nursery full until the next minor GC, a big object or a compile
+        // worker
+        object = (Obj*)reallocate(NULL, 0, size);
+    }
     object->type = type;
-    object->isMarked = false;
+    // allocated black while a concurrent mark runs, it's not in the snapshot
+    if (localHeap == NULL && vm.gcPhase == GC_CONCURRENT) {
+        setMarked(object, true);
+    }
+    object->flags = 0;
+    setObjectNext(object, NULL);
+    if (vm.heapProfile) profileAllocation(object);
 
-    //add to vm.objects linked list when creating object
-    object->next = vm.objects;
-    vm.objects = object;
+    if (!young) {
+        //add to vm.objects linked list when creating object
+        Obj** objects = localHeap != NULL ? &localHeap->objects : &vm.objects;
+        setObjectNext(object, *objects);
+        *objects = object;
+        // its fields are about to point at young objects
+        if (localHeap == NULL && type != OBJ_STRING) rememberObject(object);
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -40,12 +60,22 @@ static Obj* allocateObject(size_t size, ObjType type) {
  * @param length
  * @return
  */
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    //allocate ObjString struct on heap
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjString* allocateString(int length) {
+    ObjString* string = (ObjString*)allocateObject(
+            sizeof(ObjString) + (size_t)length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->hash = 0;
+    string->chars[length] = '\0';
+    return string;
+}
+
+static ObjString* addInterned(ObjString* string) {
+    string->obj.flags |= OBJ_INTERNED;
+    if (localHeap != NULL) {
+        // no GC on a local heap, and the VM stack isn't this thread's
+        tableSet(&localHeap->strings, string, NIL_VAL);
+        return string;
+    }
 
     //for GC
     push(OBJ_VAL(string));
@@ -56,35 +86,155 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
     return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+/**
+ * strings are interned per heap, compile workers have their own
+ */
+static Table* internTable() {
+    return localHeap != NULL ? &localHeap->strings : &vm.strings;
+}
+
+/**
+ * an unreachable interned string comes back to life when it's used again
+ */
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
+    ObjString* interned = tableFindString(internTable(), chars, length, hash);
+    if (interned != NULL && localHeap == NULL) {
+        shadeValue(OBJ_VAL(interned));
     }
-    return hash;
+    return interned;
 }
 
 /**
- * copy char array on heap, allocate a new ObjString point to
- * the copied char array.
- * @param chars
- * @param length
- * @return
+ * the interned string with these bytes, a new one holding a copy of them
+ * if there's none yet
  */
 ObjString* copyString(const char* chars, int length) {
     //calculate hash
-    uint32_t hash = hashString(chars, length);
+    uint32_t hash = hashBytes(chars, length);
     //intern string
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(chars, length, hash);
     // if already interned, return
     if (interned != NULL) return interned;
 
-    //not interned, allocate new string and copy it
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return addInterned(string);
+}
+
+ObjString* internString(ObjString* string) {
+    if (string->obj.flags & OBJ_INTERNED) return string;
+    // a copy compared again is only hashed once
+    if (string->hash == 0) {
+        string->hash = hashBytes(string->chars, string->length);
+    }
+    ObjString* interned = findInterned(string->chars, string->length,
+                                       string->hash);
+    if (interned != NULL) return interned;
+    return addInterned(string);
+}
+
+/**
+ * the bytes of a rope's pieces from left to right, a flattened piece's from
+ * its flat string. the right pieces wait on a stack of their own, ropes
+ * built by a loop are thousands deep
+ */
+static void eachPiece(ObjRope* rope,
+                      void (*visit)(const char*, int, void*),
+                      void* context) {
+    Obj** pending = NULL;
+    int count = 0;
+    int capacity = 0;
+    Obj* piece = (Obj*)rope;
+    for (;;) {
+        if (piece->type == OBJ_ROPE && ((ObjRope*)piece)->flat != NULL) {
+            piece = (Obj*)((ObjRope*)piece)->flat;
+        }
+        if (piece->type == OBJ_ROPE) {
+            if (count == capacity) {
+                capacity = GROW_CAPACITY(capacity);
+                pending = (Obj**)realloc(pending, sizeof(Obj*) * capacity);
+                if (pending == NULL) exit(1);
+            }
+            pending[count++] = ((ObjRope*)piece)->right;
+            piece = ((ObjRope*)piece)->left;
+            continue;
+        }
+        if (piece->type == OBJ_SLICE) {
+            ObjSlice* slice = (ObjSlice*)piece;
+            visit(sliceChars(slice), slice->length, context);
+        } else {
+            visit(((ObjString*)piece)->chars, ((ObjString*)piece)->length,
+                  context);
+        }
+        if (count == 0) break;
+        piece = pending[--count];
+    }
+    free(pending);
+}
+
+static void appendPiece(const char* chars, int length, void* context) {
+    char** end = (char**)context;
+    memcpy(*end, chars, length);
+    *end += length;
+}
+
+static void printPiece(const char* chars, int length, void* context) {
+    (void)context;
+    fwrite(chars, 1, length, stdout);
+}
+
+ObjRope* newRope(Obj* left, Obj* right, int length) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    ObjString* string = allocateString(rope->length);
+    char* end = string->chars;
+    eachPiece(rope, appendPiece, &end);
+
+    // the pieces are garbage now, unless shared
+    lockHeap();
+    shadeValue(OBJ_VAL(rope->left));
+    shadeValue(OBJ_VAL(rope->right));
+    rope->left = NULL;
+    rope->right = NULL;
+    rope->flat = string;
+    WRITE_BARRIER(rope, OBJ_VAL(string));
+    unlockHeap();
+    return string;
+}
+
+ObjSlice* newSlice(ObjString* parent, int start, int length) {
+    ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_SLICE);
+    slice->length = length;
+    slice->start = start;
+    slice->parent = parent;
+    // the parent may have been read out of another slice, which a
+    // concurrent mark doesn't trace through
+    WRITE_BARRIER(slice, OBJ_VAL(parent));
+    shadeValue(OBJ_VAL(parent));
+    return slice;
+}
+
+ObjString* internSlice(ObjSlice* slice) {
+    uint32_t hash = hashBytes(sliceChars(slice), slice->length);
+    ObjString* interned = findInterned(sliceChars(slice), slice->length,
+                                       hash);
+    if (interned != NULL) return interned;
+
+    ObjString* string = allocateString(slice->length);
+    // a full GC may have given the slice its own copy meanwhile
+    memcpy(string->chars, sliceChars(slice), slice->length);
+    string->hash = hash;
+    return addInterned(string);
 }
 
 static void printFunction(ObjFunction* function) {
@@ -95,6 +245,32 @@ static void printFunction(ObjFunction* function) {
     printf("<fn %s>", function->name->chars);
 }
 
+/**
+ * elements in brackets. a list met again while it's being printed, or one
+ * nested too deep, prints as [...]
+ */
+static void printList(ObjList* list) {
+    static ObjList* printing[64];
+    static int depth = 0;
+    bool seen = depth == 64;
+    for (int i = 0; i < depth && !seen; i++) {
+        seen = printing[i] == list;
+    }
+    if (seen) {
+        printf("[...]");
+        return;
+    }
+
+    printing[depth++] = list;
+    printf("[");
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) printf(", ");
+        printValue(list->items.values[i]);
+    }
+    printf("]");
+    depth--;
+}
+
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
@@ -122,31 +298,49 @@ void printObject(Value value) {
         case OBJ_UPVALUE:
             printf("upvalue");
             break;
+        case OBJ_ROPE:
+            // no copy just to print it
+            eachPiece(AS_ROPE(value), printPiece, NULL);
+            break;
+        case OBJ_SLICE:
+            fwrite(sliceChars(AS_SLICE(value)), 1, AS_SLICE(value)->length,
+                   stdout);
+            break;
+        case OBJ_MODULE:
+            if (AS_MODULE(value)->path == NULL) {
+                printf("<module>");
+            } else {
+                printf("<module %s>", AS_MODULE(value)->path->chars);
+            }
+            break;
+        case OBJ_LIST:
+            printList(AS_LIST(value));
+            break;
     }
 }
 
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    //intern string
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                          hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
-
-    return allocateString(chars, length, hash);
-}
-
 ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->name = NULL;
     initChunk(&function->chunk);
     function->upvalueCount = 0;
+    function->lazy = NULL;
+    function->module = NULL;
     return function;
 }
 
+/**
+ * drop the pending lazy body, once compiled or when the function is freed
+ */
+void freeLazyBody(ObjFunction* function) {
+    if (function->lazy == NULL) return;
+    FREE_ARRAY(ObjString*, function->lazy->upvalueNames,
+               function->upvalueCount);
+    FREE(LazyBody, function->lazy);
+    function->lazy = NULL;
+}
+
 ObjNative* newNative(NativeFn function) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
@@ -154,16 +348,15 @@ ObjNative* newNative(NativeFn function) {
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,
-                                     function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
-    }
-
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    int upvalueCount = function->upvalueCount;
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+            sizeof(ObjClosure) + sizeof(ObjUpvalue*) * upvalueCount,
+            OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
+    closure->upvalueCount = upvalueCount;
+    for (int i = 0; i < upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
 
@@ -196,4 +389,19 @@ ObjBoundMethod* newBoundMethod(Value receiver,
     bound->receiver = receiver;
     bound->method = method;
     return bound;
-}
\ No newline at end of file
+}
+
+ObjModule* newModule(ObjString* path) {
+    ObjModule* module = ALLOCATE_OBJ(ObjModule, OBJ_MODULE);
+    module->path = path;
+    initTable(&module->globals);
+    module->function = NULL;
+    module->compileErrors = NULL;
+    return module;
+}
+
+ObjList* newList() {
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    return list;
+}
@@ -5,6 +5,8 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <assert.h>
+
 #include "common.h"
 #include "value.h"
 #include "chunk.h"
@@ -19,28 +21,134 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_MODULE,
+    OBJ_ROPE,
+    OBJ_SLICE,
+    OBJ_LIST,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_LIST + 1)
+
+// old object in vm.remembered, it may point into the nursery
+#define OBJ_REMEMBERED 0x01
+// promoted or compacted object (next is the copy), or freed nursery object
+// (next is NULL)
+#define OBJ_FORWARDED 0x02
+// string in its heap's intern table. strings made at run time aren't until
+// == compares them
+#define OBJ_INTERNED 0x04
+
+/**
+ * 8 bytes. type, flags and the link are separate bytes: the marker thread
+ * reads the type while the mutator sets flags and links. the link keeps the
+ * low 48 bits of the pointer, all a user space address has on the 64 bit
+ * targets we run on
+ */
 struct Obj {
-    ObjType type;
-    struct Obj* next;
-    //for GC, mark sweep, mark phase
-    bool isMarked;
+    // an ObjType
+    uint8_t type;
+    uint8_t flags;
+    // old objects: vm.objects list. nursery objects: the copy once
+    // forwarded. see objectNext
+    uint16_t nextHigh;
+    uint32_t nextLow;
 };
 
+_Static_assert(sizeof(void*) == 8,
+               "the object link packs a 64 bit pointer into 48 bits");
+
+static inline Obj* objectNext(Obj* object) {
+    return (Obj*)(uintptr_t)(((uint64_t)object->nextHigh << 32) |
+                             object->nextLow);
+}
+
+static inline void setObjectNext(Obj* object, Obj* next) {
+    uint64_t bits = (uint64_t)(uintptr_t)next;
+    // a 57 bit address space or a tagged pointer doesn't fit
+    assert((bits >> 48) == 0);
+    object->nextHigh = (uint16_t)(bits >> 32);
+    object->nextLow = (uint32_t)bits;
+}
+
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
+    // 0 until the string is interned
     uint32_t hash;
+    // the bytes follow the header, NUL terminated
+    char chars[];
 };
 
+/**
+ * a long concatenation not copied yet: + links the two pieces, strings,
+ * slices or ropes. it's flattened the first time the bytes count, by == or
+ * a native; printing walks the pieces
+ */
 typedef struct {
+    Obj obj;
+    int length;
+    // NULL once flattened
+    Obj* left;
+    Obj* right;
+    // NULL until flattened
+    ObjString* flat;
+} ObjRope;
+
+/**
+ * bytes of another string, shared instead of copied. == copies them out to
+ * intern them. a full GC gives a short slice a copy of its own when it's
+ * all that keeps a long parent alive
+ */
+typedef struct {
+    Obj obj;
+    int length;
+    int start;
+    ObjString* parent;
+} ObjSlice;
+
+/**
+ * a function body whose bytecode has not been generated yet (lazy compile mode).
+ * the first pass only finds the end of the body and the variables it captures.
+ */
+typedef struct {
+    // from the '(' of the parameter list to past the closing '}', in a
+    // source kept alive by the VM
+    const char* start;
+    const char* end;
+    int line;
+    // FunctionType of the compiler
+    uint8_t type;
+    // enclosing class context, for 'this' and 'super'
+    bool inClass;
+    bool hasSuperclass;
+    // captured variable names, indexed like the closure's upvalues
+    ObjString** upvalueNames;
+} LazyBody;
+
+/**
+ * a loaded script file, its global variables are its namespace
+ */
+typedef struct {
+    Obj obj;
+    // canonical path, NULL for the REPL
+    ObjString* path;
+    Table globals;
+    // top level code compiled ahead of time (--jobs), run by the first import
+    struct ObjFunction* function;
+    // or its compile errors, malloc'd, reported by the first import
+    char* compileErrors;
+} ObjModule;
+
+typedef struct ObjFunction {
     Obj obj;
     int arity;
     int upvalueCount;
     Chunk chunk;
     ObjString* name;
+    // module whose globals the function reads and writes
+    ObjModule* module;
+    // not NULL until the body is compiled on first call
+    LazyBody* lazy;
 } ObjFunction;
 
 typedef struct ObjUpvalue {
@@ -55,9 +163,8 @@ typedef struct ObjUpvalue {
 typedef struct {
     Obj obj;
     ObjFunction* function;
-
-    ObjUpvalue** upvalues;
     int upvalueCount;
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
 typedef struct {
@@ -79,6 +186,14 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+/**
+ * elements side by side in one buffer, grown like a chunk's constants
+ */
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
 typedef Value (*NativeFn)(int argCount, Value* args);
 
 typedef struct {
@@ -88,6 +203,7 @@ typedef struct {
 
 
 ObjFunction* newFunction();
+void freeLazyBody(ObjFunction* function);
 ObjNative* newNative(NativeFn function);
 ObjClosure* newClosure(ObjFunction* function);
 
@@ -101,6 +217,14 @@ static inline bool isObjType(Value value, ObjType type) {
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
+#define IS_SLICE(value)        isObjType(value, OBJ_SLICE)
+#define AS_SLICE(value)        ((ObjSlice*)AS_OBJ(value))
+// what + joins
+#define IS_TEXT(value) \
+    (IS_STRING(value) || IS_ROPE(value) || IS_SLICE(value))
+
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 
@@ -124,11 +248,42 @@ ObjInstance* newInstance(ObjClass* klass);
 ObjBoundMethod* newBoundMethod(Value receiver,
                                ObjClosure* method);
 
+#define IS_MODULE(value)       isObjType(value, OBJ_MODULE)
+#define AS_MODULE(value)       ((ObjModule*)AS_OBJ(value))
+ObjModule* newModule(ObjString* path);
+
+#define IS_LIST(value)         isObjType(value, OBJ_LIST)
+#define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
+ObjList* newList();
+
 ObjString* copyString(const char* chars, int length);
+/**
+ * a string with room for length bytes, the caller fills them in. it isn't
+ * interned, internString it before it's compared or used as a key
+ */
+ObjString* allocateString(int length);
+// the interned string with the same bytes, or string itself, now interned
+ObjString* internString(ObjString* string);
 
 ObjUpvalue* newUpvalue(Value* slot);
 
+// length is the sum of the pieces', at most INT_MAX
+ObjRope* newRope(Obj* left, Obj* right, int length);
+/**
+ * a string with the rope's bytes, not interned. it allocates, the rope must
+ * be reachable
+ */
+ObjString* flattenRope(ObjRope* rope);
+
+// start and length lie within the parent, which may be a slice's parent
+ObjSlice* newSlice(ObjString* parent, int start, int length);
+// the interned string with the slice's bytes, allocated only if it's new
+ObjString* internSlice(ObjSlice* slice);
+
+static inline const char* sliceChars(ObjSlice* slice) {
+    return slice->parent->chars + slice->start;
+}
+
 void printObject(Value value);
 
-ObjString* takeString(char* chars, int length);
 #endif
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+
+#include "pool.h"
+
+#ifndef _WIN32
+
+/**
+ * hand out tasks of the current batch until it's empty, called with the lock
+ */
+static void runTasks(ThreadPool* pool) {
+    while (pool->next < pool->count) {
+        void* arg = pool->args[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+        pool->task(arg);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->count) {
+            pthread_cond_signal(&pool->idle);
+        }
+    }
+}
+
+static void* worker(void* arg) {
+    ThreadPool* pool = (ThreadPool*)arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && pool->next >= pool->count) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stopping) break;
+        runTasks(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void initPool(ThreadPool* pool, int threadCount) {
+    pool->threadCount = threadCount < 1 ? 0 : threadCount - 1;
+    pool->stopping = false;
+    pool->task = NULL;
+    pool->args = NULL;
+    pool->count = 0;
+    pool->next = 0;
+    pool->finished = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * pool->threadCount);
+    if (pool->threadCount > 0 && pool->threads == NULL) exit(1);
+    for (int i = 0; i < pool->threadCount; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0) {
+            // fewer workers, the calling thread picks up the slack
+            pool->threadCount = i;
+            break;
+        }
+    }
+}
+
+void runPool(ThreadPool* pool, PoolTask task, void** args, int count) {
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->args = args;
+    pool->count = count;
+    pool->next = 0;
+    pool->finished = 0;
+    pthread_cond_broadcast(&pool->wake);
+
+    runTasks(pool);
+    while (pool->finished < pool->count) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pool->count = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void freePool(ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->threadCount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+}
+
+#else
+
+void initPool(ThreadPool* pool, int threadCount) {
+    pool->threadCount = 0;
+    pool->stopping = false;
+}
+
+void runPool(ThreadPool* pool, PoolTask task, void** args, int count) {
+    for (int i = 0; i < count; i++) {
+        task(args[i]);
+    }
+}
+
+void freePool(ThreadPool* pool) {
+    pool->stopping = true;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "common.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+typedef void (*PoolTask)(void* arg);
+
+/**
+ * fixed set of worker threads running batches of tasks. without pthreads
+ * (Windows) batches run on the calling thread.
+ */
+typedef struct {
+#ifndef _WIN32
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    // a batch was posted, or the pool stops
+    pthread_cond_t wake;
+    // the last task of the batch finished
+    pthread_cond_t idle;
+#endif
+    int threadCount;
+    bool stopping;
+
+    // current batch
+    PoolTask task;
+    void** args;
+    int count;
+    // next argument to hand out
+    int next;
+    int finished;
+} ThreadPool;
+
+// threadCount includes the calling thread, which runs tasks too
+void initPool(ThreadPool* pool, int threadCount);
+// runs task on every argument, returns when all are done
+void runPool(ThreadPool* pool, PoolTask task, void** args, int count);
+void freePool(ThreadPool* pool);
+
+#endif
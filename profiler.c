@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "profiler.h"
+#include "vm.h"
+
+typedef struct {
+    Obj* object;
+    uint32_t value;
+} AddressEntry;
+
+/**
+ * open addressing by object address, outside the GC heap. a power of two
+ * capacity, deleted entries are tombstones until the next resize
+ */
+typedef struct {
+    AddressEntry* entries;
+    // used entries, tombstones included
+    int count;
+    int live;
+    int capacity;
+} AddressMap;
+
+#define TOMBSTONE ((Obj*)1)
+#define ADDRESS_MAX_LOAD 0.5
+
+typedef struct {
+    // NULL once the function is freed, another one may get its address
+    ObjFunction* function;
+    int line;
+    char* name;
+    char* path;
+} Site;
+
+// object -> site
+static AddressMap objectSites = {NULL, 0, 0, 0};
+// site 0 is for objects allocated with no frame, or before profiling
+static Site* sites = NULL;
+static int siteCount = 0;
+static int siteCapacity = 0;
+// (function, line) -> site, open addressing, 0 is an empty slot
+static int* siteIndex = NULL;
+static int siteIndexCapacity = 0;
+// the site of the last allocation, loops allocate from one site in a row
+static ObjFunction* lastFunction = NULL;
+static int lastLine = -1;
+static uint32_t lastSite = 0;
+
+static uint32_t hashAddress(const void* address) {
+    uint64_t hash = (uint64_t)(uintptr_t)address;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+static AddressEntry* findAddress(AddressEntry* entries, int capacity,
+                                 Obj* object) {
+    uint32_t index = hashAddress(object) & (uint32_t)(capacity - 1);
+    AddressEntry* tombstone = NULL;
+    for (;;) {
+        AddressEntry* entry = &entries[index];
+        if (entry->object == NULL) {
+            return tombstone != NULL ? tombstone : entry;
+        } else if (entry->object == TOMBSTONE) {
+            if (tombstone == NULL) tombstone = entry;
+        } else if (entry->object == object) {
+            return entry;
+        }
+        index = (index + 1) & (uint32_t)(capacity - 1);
+    }
+}
+
+static void resizeMap(AddressMap* map, int capacity) {
+    AddressEntry* entries = (AddressEntry*)calloc((size_t)capacity,
+                                                  sizeof(AddressEntry));
+    if (entries == NULL) exit(1);
+    map->count = 0;
+    for (int i = 0; i < map->capacity; i++) {
+        AddressEntry* entry = &map->entries[i];
+        if (entry->object == NULL || entry->object == TOMBSTONE) continue;
+        *findAddress(entries, capacity, entry->object) = *entry;
+        map->count++;
+    }
+    free(map->entries);
+    map->entries = entries;
+    map->capacity = capacity;
+}
+
+static void mapSet(AddressMap* map, Obj* object, uint32_t value) {
+    if (map->count + 1 > map->capacity * ADDRESS_MAX_LOAD) {
+        // mostly tombstones, objects die as fast as they're allocated
+        int capacity = 64;
+        while (capacity * ADDRESS_MAX_LOAD < (map->live + 1) * 2) {
+            capacity *= 2;
+        }
+        resizeMap(map, capacity);
+    }
+    AddressEntry* entry = findAddress(map->entries, map->capacity, object);
+    if (entry->object == NULL) map->count++;
+    if (entry->object != object) map->live++;
+    entry->object = object;
+    entry->value = value;
+}
+
+static bool mapGet(AddressMap* map, Obj* object, uint32_t* value) {
+    if (map->count == 0) return false;
+    AddressEntry* entry = findAddress(map->entries, map->capacity, object);
+    if (entry->object != object) return false;
+    *value = entry->value;
+    return true;
+}
+
+static void mapDelete(AddressMap* map, Obj* object) {
+    if (map->count == 0) return;
+    AddressEntry* entry = findAddress(map->entries, map->capacity, object);
+    if (entry->object != object) return;
+    entry->object = TOMBSTONE;
+    map->live--;
+}
+
+static void freeMap(AddressMap* map) {
+    free(map->entries);
+    map->entries = NULL;
+    map->count = 0;
+    map->live = 0;
+    map->capacity = 0;
+}
+
+static char* copyText(const char* text) {
+    size_t length = strlen(text);
+    char* copy = (char*)malloc(length + 1);
+    if (copy == NULL) exit(1);
+    memcpy(copy, text, length + 1);
+    return copy;
+}
+
+static uint32_t hashSite(ObjFunction* function, int line) {
+    return hashAddress(function) ^ ((uint32_t)line * 0x9e3779b1u);
+}
+
+static int* findSite(int* index, int capacity, ObjFunction* function,
+                     int line) {
+    uint32_t slot = hashSite(function, line) & (uint32_t)(capacity - 1);
+    for (;;) {
+        int* entry = &index[slot];
+        if (*entry == 0 || (sites[*entry].function == function &&
+                            sites[*entry].line == line)) {
+            return entry;
+        }
+        slot = (slot + 1) & (uint32_t)(capacity - 1);
+    }
+}
+
+// sites of freed functions stay in the list, not in the index
+static void resizeSiteIndex(int capacity) {
+    int* index = (int*)calloc((size_t)capacity, sizeof(int));
+    if (index == NULL) exit(1);
+    for (int i = 1; i < siteCount; i++) {
+        if (sites[i].function == NULL) continue;
+        *findSite(index, capacity, sites[i].function, sites[i].line) = i;
+    }
+    free(siteIndex);
+    siteIndex = index;
+    siteIndexCapacity = capacity;
+}
+
+static uint32_t addSite(ObjFunction* function, int line, const char* name,
+                        const char* path) {
+    if (siteCapacity < siteCount + 1) {
+        siteCapacity = GROW_CAPACITY(siteCapacity);
+        sites = (Site*)realloc(sites, sizeof(Site) * siteCapacity);
+        if (sites == NULL) exit(1);
+    }
+    Site* site = &sites[siteCount];
+    site->function = function;
+    site->line = line;
+    site->name = copyText(name);
+    site->path = copyText(path);
+    return (uint32_t)siteCount++;
+}
+
+/**
+ * the function and line the innermost frame is at
+ */
+static uint32_t currentSite() {
+    if (siteCount == 0) addSite(NULL, 0, "<unknown>", "-");
+    if (vm.frameCount == 0) return 0;
+
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    ObjFunction* function = frame->closure->function;
+    Chunk* chunk = &function->chunk;
+    int line = 0;
+    if (chunk->count > 0) {
+        size_t instruction = frame->ip > chunk->code
+                                 ? (size_t)(frame->ip - chunk->code) - 1
+                                 : 0;
+        line = chunk->lines[instruction];
+    }
+    if (function == lastFunction && line == lastLine) return lastSite;
+
+    if (siteCount * 2 >= siteIndexCapacity) {
+        resizeSiteIndex(siteIndexCapacity < 64 ? 64 : siteIndexCapacity * 2);
+    }
+    int* entry = findSite(siteIndex, siteIndexCapacity, function, line);
+    if (*entry == 0) {
+        ObjModule* module = function->module;
+        *entry = (int)addSite(function, line,
+                              function->name != NULL ? function->name->chars
+                                                     : "<script>",
+                              module != NULL && module->path != NULL
+                                  ? module->path->chars
+                                  : "-");
+    }
+    uint32_t id = (uint32_t)*entry;
+    lastFunction = function;
+    lastLine = line;
+    lastSite = id;
+    return id;
+}
+
+void profileAllocation(Obj* object) {
+    if (localHeap != NULL) return;
+    mapSet(&objectSites, object, currentSite());
+}
+
+void profileMove(Obj* from, Obj* to) {
+    uint32_t site;
+    if (mapGet(&objectSites, from, &site)) {
+        mapDelete(&objectSites, from);
+        mapSet(&objectSites, to, site);
+    }
+    if (from->type != OBJ_FUNCTION) return;
+
+    // the sites in a promoted function are found at its new address
+    bool moved = false;
+    for (int i = 1; i < siteCount; i++) {
+        if (sites[i].function != (ObjFunction*)from) continue;
+        sites[i].function = (ObjFunction*)to;
+        moved = true;
+    }
+    if (moved) resizeSiteIndex(siteIndexCapacity);
+    if (lastFunction == (ObjFunction*)from) lastFunction = NULL;
+}
+
+void profileFree(Obj* object) {
+    mapDelete(&objectSites, object);
+    if (object->type != OBJ_FUNCTION) return;
+    ObjFunction* function = (ObjFunction*)object;
+    bool retired = false;
+    for (int i = 1; i < siteCount; i++) {
+        if (sites[i].function != function) continue;
+        sites[i].function = NULL;
+        retired = true;
+    }
+    if (retired) resizeSiteIndex(siteIndexCapacity);
+    if (lastFunction == function) lastFunction = NULL;
+}
+
+void freeProfile() {
+    freeMap(&objectSites);
+    for (int i = 0; i < siteCount; i++) {
+        free(sites[i].name);
+        free(sites[i].path);
+    }
+    free(sites);
+    sites = NULL;
+    siteCount = 0;
+    siteCapacity = 0;
+    free(siteIndex);
+    siteIndex = NULL;
+    siteIndexCapacity = 0;
+    lastFunction = NULL;
+}
+
+typedef struct {
+    Obj* object;
+    // index of the object it was first reached from, -1 for a root
+    int parent;
+    // the reference: a kind, and the name of a table entry or NULL
+    const char* edge;
+    const char* name;
+} Node;
+
+typedef struct {
+    // breadth first, so parents come first and paths are short
+    Node* nodes;
+    int count;
+    int capacity;
+    AddressMap seen;
+} Snapshot;
+
+static void reach(Snapshot* snapshot, Obj* object, int parent,
+                  const char* edge, const char* name) {
+    uint32_t id;
+    if (object == NULL || mapGet(&snapshot->seen, object, &id)) return;
+    mapSet(&snapshot->seen, object, (uint32_t)snapshot->count);
+
+    if (snapshot->capacity < snapshot->count + 1) {
+        snapshot->capacity = GROW_CAPACITY(snapshot->capacity);
+        snapshot->nodes = (Node*)realloc(snapshot->nodes,
+                                         sizeof(Node) * snapshot->capacity);
+        if (snapshot->nodes == NULL) exit(1);
+    }
+    Node* node = &snapshot->nodes[snapshot->count++];
+    node->object = object;
+    node->parent = parent;
+    node->edge = edge;
+    node->name = name;
+}
+
+static void reachValue(Snapshot* snapshot, Value value, int parent,
+                       const char* edge, const char* name) {
+    if (IS_OBJ(value)) reach(snapshot, AS_OBJ(value), parent, edge, name);
+}
+
+static void reachTable(Snapshot* snapshot, Table* table, int parent,
+                       const char* edge) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        reach(snapshot, (Obj*)entry->key, parent, edge, "(key)");
+        reachValue(snapshot, entry->value, parent, edge, entry->key->chars);
+    }
+}
+
+static void reachReferences(Snapshot* snapshot, int id) {
+    Obj* object = snapshot->nodes[id].object;
+    switch (object->type) {
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            reachValue(snapshot, bound->receiver, id, "receiver", NULL);
+            reach(snapshot, (Obj*)bound->method, id, "method", NULL);
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            reach(snapshot, (Obj*)instance->klass, id, "class", NULL);
+            reachTable(snapshot, &instance->fields, id, "field");
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            reach(snapshot, (Obj*)klass->name, id, "name", NULL);
+            reachTable(snapshot, &klass->methods, id, "method");
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            reach(snapshot, (Obj*)closure->function, id, "function", NULL);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                reach(snapshot, (Obj*)closure->upvalues[i], id, "upvalue",
+                      NULL);
+            }
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            reach(snapshot, (Obj*)function->name, id, "name", NULL);
+            reach(snapshot, (Obj*)function->module, id, "module", NULL);
+            ValueArray* constants = &function->chunk.constants;
+            for (int i = 0; i < constants->count; i++) {
+                reachValue(snapshot, constants->values[i], id, "constant",
+                           NULL);
+            }
+            if (function->lazy != NULL) {
+                for (int i = 0; i < function->upvalueCount; i++) {
+                    reach(snapshot, (Obj*)function->lazy->upvalueNames[i],
+                          id, "upvalue name", NULL);
+                }
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            reachValue(snapshot, ((ObjUpvalue*)object)->closed, id, "value",
+                       NULL);
+            break;
+        case OBJ_MODULE: {
+            ObjModule* module = (ObjModule*)object;
+            reach(snapshot, (Obj*)module->path, id, "path", NULL);
+            reachTable(snapshot, &module->globals, id, "global");
+            reach(snapshot, (Obj*)module->function, id, "function", NULL);
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            reach(snapshot, rope->left, id, "left", NULL);
+            reach(snapshot, rope->right, id, "right", NULL);
+            reach(snapshot, (Obj*)rope->flat, id, "flat", NULL);
+            break;
+        }
+        case OBJ_SLICE:
+            reach(snapshot, (Obj*)((ObjSlice*)object)->parent, id, "parent",
+                  NULL);
+            break;
+        case OBJ_LIST: {
+            ValueArray* items = &((ObjList*)object)->items;
+            for (int i = 0; i < items->count; i++) {
+                reachValue(snapshot, items->values[i], id, "element", NULL);
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+static void reachRoots(Snapshot* snapshot) {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        reachValue(snapshot, *slot, -1, "stack", NULL);
+    }
+    reachTable(snapshot, &vm.globals, -1, "builtin");
+    reachTable(snapshot, &vm.modules, -1, "module");
+    reach(snapshot, (Obj*)vm.mainModule, -1, "main module", NULL);
+    for (int i = 0; i < vm.frameCount; i++) {
+        reach(snapshot, (Obj*)vm.frames[i].closure, -1, "frame", NULL);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues;
+         upvalue != NULL;
+         upvalue = upvalue->next) {
+        reach(snapshot, (Obj*)upvalue, -1, "open upvalue", NULL);
+    }
+    reach(snapshot, (Obj*)vm.initString, -1, "init string", NULL);
+}
+
+bool writeHeapSnapshot(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    // the snapshot only reads the heap, the helper thread may mark meanwhile
+    lockHeap();
+    Snapshot snapshot = {NULL, 0, 0, {NULL, 0, 0, 0}};
+    reachRoots(&snapshot);
+    for (int i = 0; i < snapshot.count; i++) reachReferences(&snapshot, i);
+
+    fprintf(file, "clox heap snapshot 1\n");
+    if (siteCount == 0) addSite(NULL, 0, "<unknown>", "-");
+    for (int i = 0; i < siteCount; i++) {
+        fprintf(file, "site %d %d %s %s\n", i, sites[i].line, sites[i].name,
+                sites[i].path);
+    }
+    for (int i = 0; i < snapshot.count; i++) {
+        Node* node = &snapshot.nodes[i];
+        uint32_t site = 0;
+        mapGet(&objectSites, node->object, &site);
+        fprintf(file, "object %d %s %zu %u %d %s%s%s\n", i,
+                objectTypeName(node->object->type),
+                objectFootprint(node->object), site, node->parent,
+                node->edge, node->name != NULL ? " " : "",
+                node->name != NULL ? node->name : "");
+    }
+    unlockHeap();
+
+    free(snapshot.nodes);
+    freeMap(&snapshot.seen);
+    bool written = !ferror(file);
+    return fclose(file) == 0 && written;
+}
@@ -0,0 +1,25 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "common.h"
+#include "object.h"
+
+/**
+ * allocation sites, recorded while vm.heapProfile is on: the function and
+ * line of the innermost call frame. objects are found by address in a side
+ * table, the GC reports moves and frees. main thread only, compile workers'
+ * objects have no site.
+ */
+void profileAllocation(Obj* object);
+void profileMove(Obj* from, Obj* to);
+void profileFree(Obj* object);
+void freeProfile();
+
+/**
+ * the objects reachable from the roots, with their size, type, site and
+ * the reference they were first reached through. tools/heapreport.c reads
+ * it. false if the file can't be written
+ */
+bool writeHeapSnapshot(const char* path);
+
+#endif
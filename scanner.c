@@ -7,27 +7,130 @@
 #include "common.h"
 #include "scanner.h"
 
+/*
+ * vectorized scanning: classify LANES_WIDTH bytes at a time to skip runs of
+ * whitespace, comments, string bodies, identifiers and digits.
+ * lanes are only loaded while that many bytes remain before scanner.end,
+ * the tail falls back to the scalar loops.
+ */
+#if !defined(SCANNER_NO_SIMD) && defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define SCANNER_SIMD
+#define LANES_WIDTH 32
+#define LANES_ALL 0xffffffffu
+typedef __m256i Lanes;
+#define lanesLoad(p)    _mm256_loadu_si256((const __m256i*)(p))
+#define lanesSplat(c)   _mm256_set1_epi8(c)
+#define lanesEq(a, b)   _mm256_cmpeq_epi8(a, b)
+#define lanesGt(a, b)   _mm256_cmpgt_epi8(a, b)
+#define lanesOr(a, b)   _mm256_or_si256(a, b)
+#define lanesAnd(a, b)  _mm256_and_si256(a, b)
+#define lanesMask(v)    ((uint32_t)_mm256_movemask_epi8(v))
+#elif !defined(SCANNER_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SCANNER_SIMD
+#define LANES_WIDTH 16
+#define LANES_ALL 0xffffu
+typedef __m128i Lanes;
+#define lanesLoad(p)    _mm_loadu_si128((const __m128i*)(p))
+#define lanesSplat(c)   _mm_set1_epi8(c)
+#define lanesEq(a, b)   _mm_cmpeq_epi8(a, b)
+#define lanesGt(a, b)   _mm_cmpgt_epi8(a, b)
+#define lanesOr(a, b)   _mm_or_si128(a, b)
+#define lanesAnd(a, b)  _mm_and_si128(a, b)
+#define lanesMask(v)    ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
 typedef struct {
     //start char index of current token
     const char *start;
     //current char index
     const char *current;
+    // one past the last char to scan
+    const char *end;
     // line number
     int line;
 } Scanner;
 
-Scanner scanner;
+THREAD_LOCAL Scanner scanner;
 
 void initScanner(const char *source) {
+    initScannerAt(source, source + strlen(source), 1);
+}
+
+/**
+ * resume scanning in the middle of a source, eg. a lazily compiled function body
+ */
+void initScannerAt(const char *source, const char *end, int line) {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.end = end;
+    scanner.line = line;
 }
 
 static bool isAtEnd() {
-    return *scanner.current == '\0';
+    return scanner.current >= scanner.end;
+}
+
+#ifdef SCANNER_SIMD
+/**
+ * true in a lane when lo <= c <= hi, for ASCII bounds
+ */
+static inline Lanes lanesInRange(Lanes chars, char lo, char hi) {
+    return lanesAnd(lanesGt(chars, lanesSplat((char)(lo - 1))),
+                    lanesGt(lanesSplat((char)(hi + 1)), chars));
+}
+
+static inline uint32_t whitespaceMask(const char *p, uint32_t *newlines) {
+    Lanes chars = lanesLoad(p);
+    Lanes newline = lanesEq(chars, lanesSplat('\n'));
+    *newlines = lanesMask(newline);
+    Lanes blank = lanesOr(lanesOr(lanesEq(chars, lanesSplat(' ')),
+                                  lanesEq(chars, lanesSplat('\t'))),
+                          lanesOr(lanesEq(chars, lanesSplat('\r')), newline));
+    return lanesMask(blank);
+}
+
+static inline uint32_t digitMask(const char *p) {
+    return lanesMask(lanesInRange(lanesLoad(p), '0', '9'));
 }
 
+static inline uint32_t identifierMask(const char *p) {
+    Lanes chars = lanesLoad(p);
+    // folding case with | 0x20 maps exactly 'A'..'Z' onto 'a'..'z'
+    Lanes letter = lanesInRange(lanesOr(chars, lanesSplat(0x20)), 'a', 'z');
+    Lanes digit = lanesInRange(chars, '0', '9');
+    Lanes underscore = lanesEq(chars, lanesSplat('_'));
+    return lanesMask(lanesOr(lanesOr(letter, digit), underscore));
+}
+
+/**
+ * count the lines before lane n, then move past it
+ */
+static inline void skipLanes(int n, uint32_t newlines) {
+    if (n < LANES_WIDTH) newlines &= (1u << n) - 1;
+    scanner.line += __builtin_popcount(newlines);
+    scanner.current += n;
+}
+
+// runs shorter than this are cheaper to finish with the scalar loops
+#define SHORT_RUN 8
+
+/**
+ * advance while the lanes selected by classify() are set, at most to
+ * the last full block before scanner.end
+ */
+#define SKIP_WHILE(classify) \
+    while (scanner.end - scanner.current >= LANES_WIDTH) { \
+        uint32_t stop = ~(classify(scanner.current)) & LANES_ALL; \
+        if (stop != 0) { \
+            scanner.current += __builtin_ctz(stop); \
+            break; \
+        } \
+        scanner.current += LANES_WIDTH; \
+    }
+#endif
+
 static Token makeToken(TokenType type) {
     Token token;
     token.type = type;
@@ -67,6 +170,27 @@ static char peekNext() {
     return scanner.current[1];
 }
 
+/**
+ * skip a run of whitespace, or the rest of a comment up to its '\n'
+ */
+static void skipLongRun(bool comment) {
+#ifdef SCANNER_SIMD
+    while (scanner.end - scanner.current >= LANES_WIDTH) {
+        uint32_t newlines;
+        uint32_t blank = whitespaceMask(scanner.current, &newlines);
+        uint32_t stop = comment ? newlines : ~blank & LANES_ALL;
+        if (stop != 0) {
+            skipLanes(__builtin_ctz(stop), newlines);
+            return;
+        }
+        skipLanes(LANES_WIDTH, newlines);
+    }
+#endif
+    if (comment) {
+        while (peek() != '\n' && !isAtEnd()) advance();
+    }
+}
+
 static void skipWhitespace() {
     for (;;) {
         char c = peek();
@@ -79,11 +203,13 @@ static void skipWhitespace() {
             case '\n':
                 scanner.line++;
                 advance();
+                // indentation, the long runs of whitespace
+                if (peek() == ' ' || peek() == '\t') skipLongRun(false);
                 break;
             case '/':
                 if (peekNext() == '/') {
                     // A comment goes until the end of the line.
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                    skipLongRun(true);
                 } else {
                     return;
                 }
@@ -95,6 +221,18 @@ static void skipWhitespace() {
 }
 
 static Token string() {
+#ifdef SCANNER_SIMD
+    while (scanner.end - scanner.current >= LANES_WIDTH) {
+        Lanes chars = lanesLoad(scanner.current);
+        uint32_t newlines = lanesMask(lanesEq(chars, lanesSplat('\n')));
+        uint32_t quotes = lanesMask(lanesEq(chars, lanesSplat('"')));
+        if (quotes != 0) {
+            skipLanes(__builtin_ctz(quotes), newlines);
+            break;
+        }
+        skipLanes(LANES_WIDTH, newlines);
+    }
+#endif
     while (peek() != '"' && !isAtEnd()) {
         if (peek() == '\n') scanner.line++;
         advance();
@@ -111,15 +249,27 @@ static bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
 
+static void digits() {
+#ifdef SCANNER_SIMD
+    int length = 0;
+#endif
+    while (isDigit(peek())) {
+        advance();
+#ifdef SCANNER_SIMD
+        if (++length == SHORT_RUN) SKIP_WHILE(digitMask)
+#endif
+    }
+}
+
 static Token number() {
-    while (isDigit(peek())) advance();
+    digits();
 
     // Look for a fractional part.
     if (peek() == '.' && isDigit(peekNext())) {
         // Consume the ".".
         advance();
 
-        while (isDigit(peek())) advance();
+        digits();
     }
 
     return makeToken(TOKEN_NUMBER);
@@ -150,7 +300,15 @@ static TokenType identifierType() {
         case 'e':
             return checkKeyword(1, 3, "lse", TOKEN_ELSE);
         case 'i':
-            return checkKeyword(1, 1, "f", TOKEN_IF);
+            if (scanner.current - scanner.start > 1) {
+                switch (scanner.start[1]) {
+                    case 'f':
+                        return checkKeyword(2, 0, "", TOKEN_IF);
+                    case 'm':
+                        return checkKeyword(2, 4, "port", TOKEN_IMPORT);
+                }
+            }
+            break;
         case 'n':
             return checkKeyword(1, 2, "il", TOKEN_NIL);
         case 'o':
@@ -192,7 +350,15 @@ static TokenType identifierType() {
 }
 
 static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
+#ifdef SCANNER_SIMD
+    int length = 1;
+#endif
+    while (isAlpha(peek()) || isDigit(peek())) {
+        advance();
+#ifdef SCANNER_SIMD
+        if (++length == SHORT_RUN) SKIP_WHILE(identifierMask)
+#endif
+    }
     return makeToken(identifierType());
 }
 
@@ -214,6 +380,10 @@ Token scanToken() {
             return makeToken(TOKEN_LEFT_BRACE);
         case '}':
             return makeToken(TOKEN_RIGHT_BRACE);
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
         case ',':
@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "slab.h"
+
+#ifndef SLAB_USE_MALLOC
+
+#define SMALL_CLASSES (SLAB_SMALL_BLOCK / SLAB_GRANULE)
+// log2 of SLAB_SMALL_BLOCK, four doublings up to SLAB_MAX_BLOCK
+#define SMALL_SHIFT 9
+#define SLAB_CLASS_COUNT (SMALL_CLASSES + 4 * 4)
+// empty pages kept for reuse, the rest go back to the system
+#define SLAB_CACHED_PAGES 16
+// the mapping of a large block is a multiple of this
+#define LARGE_ROUNDING 4096
+
+#define PAGE_OF(pointer) \
+    ((SlabPage*)((uintptr_t)(pointer) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+
+#define PAGE_HEADER \
+    ((sizeof(SlabPage) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1))
+
+// pages of each class with at least one free block
+static SlabPage* partial[SLAB_CLASS_COUNT];
+static SlabPage* emptyPages = NULL;
+static int emptyCount = 0;
+// pages a compaction empties
+static SlabPage* evacuatingPages = NULL;
+// pages holding blocks, and the bytes of those blocks
+static size_t pagesInUse = 0;
+static size_t liveBytes = 0;
+
+static void linkPage(SlabPage** list, SlabPage* page) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list != NULL) (*list)->prev = page;
+    *list = page;
+}
+
+static void unlinkPage(SlabPage** list, SlabPage* page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        *list = page->next;
+    }
+    if (page->next != NULL) page->next->prev = page->prev;
+}
+
+static int classOf(size_t size) {
+    if (size <= SLAB_SMALL_BLOCK) return (int)((size - 1) / SLAB_GRANULE);
+    int shift = SMALL_SHIFT;
+    while (((size - 1) >> (shift + 1)) != 0) shift++;
+    size_t step = (size_t)1 << (shift - 2);
+    return SMALL_CLASSES + (shift - SMALL_SHIFT) * 4 +
+           (int)((size - 1 - ((size_t)1 << shift)) / step);
+}
+
+static size_t classSize(int sizeClass) {
+    if (sizeClass < SMALL_CLASSES) {
+        return (size_t)(sizeClass + 1) * SLAB_GRANULE;
+    }
+    int medium = sizeClass - SMALL_CLASSES;
+    int shift = SMALL_SHIFT + medium / 4;
+    return ((size_t)1 << shift) +
+           (size_t)(medium % 4 + 1) * ((size_t)1 << (shift - 2));
+}
+
+static bool isFull(SlabPage* page) {
+    return page->freeList == NULL && page->bump + page->blockSize > page->end;
+}
+
+/**
+ * pages are mapped one by one, so a released one goes back to the system.
+ * a large block's page is longer, it's still aligned to SLAB_PAGE_SIZE
+ */
+static SlabPage* mapPage(size_t size) {
+#ifdef _WIN32
+    SlabPage* page = (SlabPage*)_aligned_malloc(size, SLAB_PAGE_SIZE);
+    if (page == NULL) exit(1);
+    return page;
+#else
+    // a page more, what's around the aligned one is unmapped again
+    size_t length = size + SLAB_PAGE_SIZE;
+    uint8_t* start = (uint8_t*)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) exit(1);
+    uint8_t* page = (uint8_t*)(((uintptr_t)start + SLAB_PAGE_SIZE - 1) &
+                               ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    uint8_t* end = page + size;
+    if (page > start) munmap(start, (size_t)(page - start));
+    if (start + length > end) munmap(end, (size_t)(start + length - end));
+    return (SlabPage*)page;
+#endif
+}
+
+static void freePage(SlabPage* page) {
+#ifdef _WIN32
+    _aligned_free(page);
+#else
+    munmap(page, (size_t)(page->end - (uint8_t*)page));
+#endif
+}
+
+static void releasePage(SlabPage* page) {
+    pagesInUse--;
+    if (emptyCount < SLAB_CACHED_PAGES) {
+        linkPage(&emptyPages, page);
+        emptyCount++;
+    } else {
+        freePage(page);
+    }
+}
+
+static SlabPage* newPage(int sizeClass) {
+    SlabPage* page = emptyPages;
+    if (page != NULL) {
+        unlinkPage(&emptyPages, page);
+        emptyCount--;
+    } else {
+        page = mapPage(SLAB_PAGE_SIZE);
+    }
+    pagesInUse++;
+
+    memset(page->marks, 0, sizeof(page->marks));
+    page->freeList = NULL;
+    page->bump = (uint8_t*)page + PAGE_HEADER;
+    page->end = (uint8_t*)page + SLAB_PAGE_SIZE;
+    page->blockSize = classSize(sizeClass);
+    page->live = 0;
+    page->sizeClass = sizeClass;
+    page->evacuating = false;
+    linkPage(&partial[sizeClass], page);
+    return page;
+}
+
+/**
+ * a page of its own, its header is a normal page's. it has no holes, the
+ * fragmentation leaves it out
+ */
+static void* allocateLarge(size_t size) {
+    size_t length = (PAGE_HEADER + size + LARGE_ROUNDING - 1) &
+                    ~(size_t)(LARGE_ROUNDING - 1);
+    SlabPage* page = mapPage(length);
+    page->prev = NULL;
+    page->next = NULL;
+    memset(page->marks, 0, sizeof(page->marks));
+    page->freeList = NULL;
+    page->end = (uint8_t*)page + length;
+    page->bump = page->end;
+    page->blockSize = length - PAGE_HEADER;
+    page->live = 1;
+    page->sizeClass = SLAB_LARGE;
+    page->evacuating = false;
+    return (uint8_t*)page + PAGE_HEADER;
+}
+
+void* slabAllocate(size_t size) {
+    if (size > SLAB_MAX_BLOCK) return allocateLarge(size);
+
+    int sizeClass = classOf(size);
+    SlabPage* page = partial[sizeClass];
+    if (page == NULL) page = newPage(sizeClass);
+
+    void* block;
+    if (page->freeList != NULL) {
+        block = page->freeList;
+        page->freeList = *(void**)block;
+    } else {
+        block = page->bump;
+        page->bump += page->blockSize;
+    }
+    page->live++;
+    liveBytes += page->blockSize;
+    if (isFull(page)) unlinkPage(&partial[sizeClass], page);
+    return block;
+}
+
+void slabFree(void* pointer, size_t size) {
+    if (pointer == NULL) return;
+    SlabPage* page = PAGE_OF(pointer);
+    if (size > SLAB_MAX_BLOCK) {
+        freePage(page);
+        return;
+    }
+
+    bool wasFull = isFull(page);
+    *(void**)pointer = page->freeList;
+    page->freeList = pointer;
+    liveBytes -= page->blockSize;
+
+    if (page->evacuating) {
+        if (--page->live == 0) {
+            unlinkPage(&evacuatingPages, page);
+            releasePage(page);
+        }
+        return;
+    }
+    if (--page->live == 0) {
+        if (!wasFull) unlinkPage(&partial[page->sizeClass], page);
+        releasePage(page);
+    } else if (wasFull) {
+        linkPage(&partial[page->sizeClass], page);
+    }
+}
+
+void* slabResize(void* pointer, size_t oldSize, size_t newSize) {
+    if (pointer == NULL) return slabAllocate(newSize);
+    if (oldSize > SLAB_MAX_BLOCK && newSize > SLAB_MAX_BLOCK) {
+        // a large block keeps its mapping while it's at least half used
+        size_t capacity = PAGE_OF(pointer)->blockSize;
+        if (newSize <= capacity && newSize > capacity / 2) return pointer;
+    } else if (oldSize <= SLAB_MAX_BLOCK && newSize <= SLAB_MAX_BLOCK &&
+               classOf(oldSize) == classOf(newSize)) {
+        return pointer;
+    }
+
+    void* result = slabAllocate(newSize);
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    slabFree(pointer, oldSize);
+    return result;
+}
+
+void freeSlabs() {
+    while (emptyPages != NULL) {
+        SlabPage* page = emptyPages;
+        emptyPages = page->next;
+        freePage(page);
+    }
+    emptyCount = 0;
+}
+
+double slabFragmentation() {
+    if (pagesInUse == 0) return 0;
+    size_t usable = pagesInUse * (SLAB_PAGE_SIZE - PAGE_HEADER);
+    return 1.0 - (double)liveBytes / (double)usable;
+}
+
+int slabBeginEvacuation(double occupancy) {
+    int count = 0;
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        SlabPage* page = partial[i];
+        while (page != NULL) {
+            SlabPage* next = page->next;
+            // a page just started has no holes, only room left
+            size_t used = (size_t)(page->bump - ((uint8_t*)page + PAGE_HEADER));
+            if ((double)(page->live * page->blockSize) <= occupancy * used) {
+                unlinkPage(&partial[i], page);
+                page->evacuating = true;
+                linkPage(&evacuatingPages, page);
+                count++;
+            }
+            page = next;
+        }
+    }
+    return count;
+}
+
+bool slabIsEvacuating(void* block, size_t size) {
+    return size <= SLAB_MAX_BLOCK && PAGE_OF(block)->evacuating;
+}
+
+void slabEndEvacuation() {
+    while (evacuatingPages != NULL) {
+        SlabPage* page = evacuatingPages;
+        unlinkPage(&evacuatingPages, page);
+        page->evacuating = false;
+        linkPage(&partial[page->sizeClass], page);
+    }
+}
+
+#else
+
+void* slabAllocate(size_t size) {
+    uint8_t* result = (uint8_t*)malloc(SLAB_BLOCK_HEADER + size);
+    if (result == NULL) exit(1);
+    memset(result, 0, SLAB_BLOCK_HEADER);
+    return result + SLAB_BLOCK_HEADER;
+}
+
+void slabFree(void* pointer, size_t size) {
+    (void)size;
+    if (pointer == NULL) return;
+    free((uint8_t*)pointer - SLAB_BLOCK_HEADER);
+}
+
+void* slabResize(void* pointer, size_t oldSize, size_t newSize) {
+    (void)oldSize;
+    if (pointer == NULL) return slabAllocate(newSize);
+    uint8_t* result = (uint8_t*)realloc((uint8_t*)pointer - SLAB_BLOCK_HEADER,
+                                        SLAB_BLOCK_HEADER + newSize);
+    if (result == NULL) exit(1);
+    return result + SLAB_BLOCK_HEADER;
+}
+
+void freeSlabs() {
+}
+
+double slabFragmentation() {
+    return 0;
+}
+
+int slabBeginEvacuation(double occupancy) {
+    (void)occupancy;
+    return 0;
+}
+
+bool slabIsEvacuating(void* block, size_t size) {
+    (void)block;
+    (void)size;
+    return false;
+}
+
+void slabEndEvacuation() {
+}
+
+#endif
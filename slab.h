@@ -0,0 +1,108 @@
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include "common.h"
+
+#ifndef _WIN32
+#include <stdatomic.h>
+#endif
+
+// blocks up to this size come in classes 16 bytes apart, then four
+// classes per doubling up to SLAB_MAX_BLOCK. bigger blocks are mapped on
+// their own, behind a page header that holds their mark bit
+#define SLAB_SMALL_BLOCK 512
+#define SLAB_MAX_BLOCK 8192
+// pages are aligned to their size, a block finds its page by masking
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_GRANULE 16
+#define SLAB_PAGE_GRANULES (SLAB_PAGE_SIZE / SLAB_GRANULE)
+
+/**
+ * a word of mark bits. while the marker thread runs it sets bits next to the
+ * mutator's, MARK_SET_SHARED is atomic then. otherwise one thread has them
+ */
+#ifndef _WIN32
+typedef _Atomic uint64_t MarkWord;
+#define MARK_LOAD(word) atomic_load_explicit(&(word), memory_order_relaxed)
+#define MARK_STORE(word, bits) \
+    atomic_store_explicit(&(word), (bits), memory_order_relaxed)
+#define MARK_SET_SHARED(word, bit) \
+    atomic_fetch_or_explicit(&(word), (bit), memory_order_relaxed)
+#else
+typedef uint64_t MarkWord;
+#define MARK_LOAD(word) (word)
+#define MARK_STORE(word, bits) ((word) = (bits))
+#define MARK_SET_SHARED(word, bit) ((word) |= (bit))
+#endif
+#define MARK_TEST(word, bit) ((MARK_LOAD(word) & (bit)) != 0)
+#define MARK_SET(word, bit) MARK_STORE(word, MARK_LOAD(word) | (bit))
+#define MARK_CLEAR(word, bit) MARK_STORE(word, MARK_LOAD(word) & ~(bit))
+
+typedef struct SlabPage {
+    // neighbours in its class's list of pages with free blocks, or the cache
+    struct SlabPage* prev;
+    struct SlabPage* next;
+    // blocks freed on this page, linked through their first word
+    void* freeList;
+    // blocks from here on were never handed out
+    uint8_t* bump;
+    uint8_t* end;
+    size_t blockSize;
+    int live;
+    // SLAB_LARGE for a block mapped on its own
+    int sizeClass;
+    // a compaction moves the blocks out, nothing is allocated here
+    bool evacuating;
+    // a bit per granule, marking leaves the blocks untouched. the bits of
+    // free blocks are clear
+    MarkWord marks[SLAB_PAGE_GRANULES / 64];
+} SlabPage;
+
+#define SLAB_LARGE (-1)
+
+/**
+ * segregated size classes for objects and arrays. a page holds blocks of
+ * one class, pages whose blocks are all free go back to a shared cache and
+ * may be reused for any class. not thread safe, the caller locks.
+ */
+void* slabAllocate(size_t size);
+// size must be the one the block was allocated with
+void slabFree(void* pointer, size_t size);
+void* slabResize(void* pointer, size_t oldSize, size_t newSize);
+// releases cached empty pages
+void freeSlabs();
+
+// share of the bytes in used pages that no block holds
+double slabFragmentation();
+/**
+ * pages whose handed out blocks are mostly holes stop taking allocations,
+ * returns how many. blocks moved out of them with slabFree free them up
+ */
+int slabBeginEvacuation(double occupancy);
+bool slabIsEvacuating(void* block, size_t size);
+// pages with blocks left take allocations again
+void slabEndEvacuation();
+
+#ifndef SLAB_USE_MALLOC
+/**
+ * the word and bit holding the mark of a block, a large one's page header
+ * comes first in its mapping too
+ */
+static inline MarkWord* slabMarkWord(void* block, uint64_t* bit) {
+    SlabPage* page = (SlabPage*)((uintptr_t)block &
+                                 ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    size_t granule = (size_t)((uint8_t*)block - (uint8_t*)page) / SLAB_GRANULE;
+    *bit = (uint64_t)1 << (granule % 64);
+    return &page->marks[granule / 64];
+}
+#else
+// every malloc'd block has a word of marks in front of it
+#define SLAB_BLOCK_HEADER 16
+
+static inline MarkWord* slabMarkWord(void* block, uint64_t* bit) {
+    *bit = 1;
+    return (MarkWord*)((uint8_t*)block - SLAB_BLOCK_HEADER);
+}
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "source.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SOURCE_MMAP
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SOURCE_CHUNK (64 * 1024)
+
+static bool sourceError(const char* message, const char* path) {
+    fprintf(stderr, message, path);
+    return false;
+}
+
+/**
+ * read until EOF in growing chunks, works on pipes and terminals where the
+ * size is not known up front
+ */
+static bool streamSource(Source* source, FILE* file, const char* path) {
+    size_t capacity = SOURCE_CHUNK;
+    size_t length = 0;
+    char* buffer = (char*)malloc(capacity);
+    if (buffer == NULL) {
+        return sourceError("Not enough memory to read \"%s\".\n", path);
+    }
+
+    for (;;) {
+        // always keep room for the terminator
+        if (capacity - length < SOURCE_CHUNK / 2) {
+            capacity *= 2;
+            char* grown = (char*)realloc(buffer, capacity);
+            if (grown == NULL) {
+                free(buffer);
+                return sourceError("Not enough memory to read \"%s\".\n", path);
+            }
+            buffer = grown;
+        }
+
+        size_t bytesRead = fread(buffer + length, 1,
+                                 capacity - length - 1, file);
+        length += bytesRead;
+        if (bytesRead == 0) break;
+    }
+    if (ferror(file)) {
+        free(buffer);
+        return sourceError("Could not read file \"%s\".\n", path);
+    }
+
+    buffer[length] = '\0';
+    source->chars = buffer;
+    source->length = length;
+    source->mappedSize = 0;
+    return true;
+}
+
+#ifdef SOURCE_MMAP
+/**
+ * map the file read only. the mapping is laid over a zeroed anonymous one at
+ * least one byte larger, so the text ends with '\0' even when the file size
+ * is a multiple of the page size, and nothing has to be copied.
+ */
+static bool mapSource(Source* source, int fd, size_t length) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (length / page + 1) * page;
+
+    char* base = mmap(NULL, size, PROT_READ,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return false;
+
+    if (length > 0) {
+        if (mmap(base, length, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                 fd, 0) == MAP_FAILED) {
+            munmap(base, size);
+            return false;
+        }
+        // the scanner reads front to back exactly once
+        madvise(base, length, MADV_SEQUENTIAL);
+    }
+
+    source->chars = base;
+    source->length = length;
+    source->mappedSize = size;
+    return true;
+}
+#endif
+
+bool readSource(Source* source, const char* path) {
+    if (strcmp(path, "-") == 0) {
+        return streamSource(source, stdin, "<stdin>");
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return sourceError("Could not open file \"%s\".\n", path);
+
+#ifdef SOURCE_MMAP
+    struct stat info;
+    if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) &&
+        mapSource(source, fileno(file), (size_t)info.st_size)) {
+        // the mapping stays valid after the descriptor is closed
+        fclose(file);
+        return true;
+    }
+#endif
+
+    // pipes, devices, or no mmap on this platform
+    bool read = streamSource(source, file, path);
+    fclose(file);
+    return read;
+}
+
+bool resolveSourcePath(const char* from, const char* path,
+                       char* resolved, size_t size) {
+    char joined[SOURCE_PATH_MAX];
+    const char* slash = from == NULL ? NULL : strrchr(from, '/');
+    if (path[0] == '/' || slash == NULL) {
+        snprintf(joined, sizeof(joined), "%s", path);
+    } else {
+        // relative to the directory of the importing file
+        snprintf(joined, sizeof(joined), "%.*s/%s",
+                 (int)(slash - from), from, path);
+    }
+
+#ifdef SOURCE_MMAP
+    char canonical[PATH_MAX];
+    if (realpath(joined, canonical) == NULL) return false;
+    snprintf(resolved, size, "%s", canonical);
+#else
+    snprintf(resolved, size, "%s", joined);
+#endif
+    return true;
+}
+
+void copySource(Source* source, const char* chars) {
+    size_t length = strlen(chars);
+    char* buffer = (char*)malloc(length + 1);
+    if (buffer == NULL) exit(1);
+    memcpy(buffer, chars, length + 1);
+
+    source->chars = buffer;
+    source->length = length;
+    source->mappedSize = 0;
+}
+
+void freeSource(Source* source) {
+#ifdef SOURCE_MMAP
+    if (source->mappedSize > 0) {
+        munmap((void*)source->chars, source->mappedSize);
+        source->chars = NULL;
+        return;
+    }
+#endif
+    free((void*)source->chars);
+    source->chars = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef clox_source_h
+#define clox_source_h
+
+#include "common.h"
+
+/**
+ * a script's text, always '\0' terminated so the scanner can work on it
+ * in place: a memory mapping for regular files, a heap buffer otherwise.
+ */
+typedef struct {
+    const char* chars;
+    size_t length;
+    // size of the mapping to unmap, 0 when chars is a heap buffer
+    size_t mappedSize;
+} Source;
+
+#define SOURCE_PATH_MAX 4096
+
+// path "-" reads stdin. reports errors on stderr and returns false
+bool readSource(Source* source, const char* path);
+/**
+ * canonical path of a file imported from the file 'from' (NULL for the
+ * working directory), relative paths are resolved against its directory.
+ * false if the file does not exist.
+ */
+bool resolveSourcePath(const char* from, const char* path,
+                       char* resolved, size_t size);
+void copySource(Source* source, const char* chars);
+void freeSource(Source* source);
+#endif
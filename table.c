@@ -9,7 +9,174 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+/*
+ * open addressing in groups of slots. each slot has a control byte after
+ * the entries: EMPTY, DELETED, or the low 7 bits of its key's hash. a probe
+ * compares a whole group of control bytes at once, and only looks at the
+ * entries whose byte matches. the rest of the hash picks the first group,
+ * the next ones follow in triangular steps. a probe stops at the first
+ * group with an EMPTY slot, or when it has seen them all. small tables,
+ * most instances' fields and classes' methods, are plain arrays instead.
+ */
+#if !defined(TABLE_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TABLE_SIMD
+#define GROUP_WIDTH 16
+typedef __m128i Group;
+// a bit for each matching slot
+typedef uint32_t Match;
+#else
+// eight control bytes in a word
+#define GROUP_WIDTH 8
+typedef uint64_t Group;
+// the top bit of each matching slot's byte
+typedef uint64_t Match;
+#define GROUP_LSB 0x0101010101010101ull
+#define GROUP_MSB 0x8080808080808080ull
+#endif
+
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+// pads the group of a table smaller than one, never free or matching
+#define CONTROL_SENTINEL ((uint8_t)0xff)
+
+#define TABLE_MIN_CAPACITY 4
+
+/**
+ * a table of up to this many slots keeps its entries packed at the front
+ * and finds a key by comparing pointers, without hashing or control bytes
+ */
+#define TABLE_SMALL_CAPACITY 8
+
+static inline bool isSmall(int capacity) {
+    return capacity <= TABLE_SMALL_CAPACITY;
+}
+
+static int controlCount(int capacity) {
+    return capacity < GROUP_WIDTH ? GROUP_WIDTH : capacity;
+}
+
+/**
+ * capacity * 7 / 8 slots may be used, tombstones included. a table of one
+ * group may fill up, a probe of it ends after the group anyway
+ */
+static int maxLoad(int capacity) {
+    if (capacity <= GROUP_WIDTH) return capacity;
+    return capacity - capacity / 8;
+}
+
+size_t tableBytes(int capacity) {
+    if (isSmall(capacity)) return sizeof(Entry) * (size_t)capacity;
+    return sizeof(Entry) * (size_t)capacity + (size_t)controlCount(capacity);
+}
+
+static inline uint8_t* controlBytes(Entry* entries, int capacity) {
+    return (uint8_t*)(entries + capacity);
+}
+
+static inline uint8_t hashControl(uint32_t hash) {
+    return (uint8_t)(hash & 0x7f);
+}
+
+/**
+ * the rest of the hash picks a slot, and so the group a probe starts at.
+ * an insert takes it when it's free, a lookup tries it before the group
+ */
+static inline int homeSlot(int capacity, uint32_t hash) {
+    return (int)(hash >> 7) & (capacity - 1);
+}
+
+#ifdef TABLE_SIMD
+static inline Group loadGroup(const uint8_t* control) {
+    return _mm_loadu_si128((const __m128i*)control);
+}
+
+// the slots of the group holding byte
+static inline Match matchByte(Group group, uint8_t byte) {
+    return (Match)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+}
+
+static inline Match matchEmpty(Group group) {
+    return matchByte(group, CONTROL_EMPTY);
+}
+
+static inline Match matchFree(Group group) {
+    return matchByte(group, CONTROL_EMPTY) | matchByte(group, CONTROL_DELETED);
+}
+
+static inline int lowestSlot(Match match) {
+    return __builtin_ctz(match);
+}
+
+static inline void storeGroup(uint8_t* control, Group group) {
+    _mm_storeu_si128((__m128i*)control, group);
+}
+
+static inline Group replaceByte(Group group, int lane, uint8_t byte) {
+    static const int8_t lanes[GROUP_WIDTH] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+                                              10, 11, 12, 13, 14, 15};
+    __m128i mask = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)lanes),
+                                  _mm_set1_epi8((char)lane));
+    return _mm_or_si128(_mm_and_si128(mask, _mm_set1_epi8((char)byte)),
+                        _mm_andnot_si128(mask, group));
+}
+#else
+static inline Group loadGroup(const uint8_t* control) {
+    Group group;
+    memcpy(&group, control, sizeof(group));
+    return group;
+}
+
+// bytes equal to byte have their top bit set. a byte above a match may be
+// set too, the caller compares the keys anyway
+static inline Match matchByte(Group group, uint8_t byte) {
+    Group bytes = group ^ (GROUP_LSB * byte);
+    return (bytes - GROUP_LSB) & ~bytes & GROUP_MSB;
+}
+
+// exactly: EMPTY is the only control byte with bit 7 set and bit 1 clear
+static inline Match matchEmpty(Group group) {
+    return group & ~(group << 6) & GROUP_MSB;
+}
+
+// EMPTY and DELETED have bit 7 set and bit 0 clear, the sentinel doesn't
+static inline Match matchFree(Group group) {
+    return group & ~(group << 7) & GROUP_MSB;
+}
+
+static inline int lowestSlot(Match match) {
+#ifdef __GNUC__
+    return __builtin_ctzll(match) / 8;
+#else
+    int slot = 0;
+    while ((match & 0x80) == 0) {
+        match >>= 8;
+        slot++;
+    }
+    return slot;
+#endif
+}
+
+static inline void storeGroup(uint8_t* control, Group group) {
+    memcpy(control, &group, sizeof(group));
+}
+
+// little endian like loadGroup's memcpy is assumed by lowestSlot
+static inline Group replaceByte(Group group, int lane, uint8_t byte) {
+    int shift = lane * 8;
+    return (group & ~((Group)0xff << shift)) | ((Group)byte << shift);
+}
+#endif
+
+/**
+ * probes load a whole group. a byte store and then a wider load of it
+ * can't forward and stall, so a control byte is set by storing its group
+ */
+static inline void setControl(uint8_t* control, int slot, uint8_t byte) {
+    uint8_t* group = control + slot - slot % GROUP_WIDTH;
+    storeGroup(group, replaceByte(loadGroup(group), slot % GROUP_WIDTH, byte));
+}
 
 void initTable(Table* table) {
     table->count = 0;
@@ -18,79 +185,180 @@ void initTable(Table* table) {
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    reallocate(table->entries, tableBytes(table->capacity), 0);
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity,
-                        ObjString* key);
-static void adjustCapacity(Table* table, int capacity);
+static inline int probeKey(Entry* entries, int capacity, ObjString* key) {
+    int home = homeSlot(capacity, key->hash);
+    if (entries[home].key == key) return home;
 
-bool tableSet(Table* table, ObjString* key, Value value) {
-    //grow
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    uint8_t* control = controlBytes(entries, capacity);
+    uint8_t byte = hashControl(key->hash);
+    int groupMask = (capacity - 1) / GROUP_WIDTH;
+    int group = home / GROUP_WIDTH;
+    for (int step = 1;; step++) {
+        int first = group * GROUP_WIDTH;
+        Group bytes = loadGroup(control + first);
+        for (Match match = matchByte(bytes, byte);
+             match != 0; match &= match - 1) {
+            int slot = first + lowestSlot(match);
+            if (entries[slot].key == key) return slot;
+        }
+        if (matchEmpty(bytes) != 0 || step > groupMask) return -1;
+        group = (group + step) & groupMask;
     }
-
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    //tomb stone already counted, so don't count here
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
-
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
 }
 
-static Entry* findEntry(Entry* entries, int capacity,
-                        ObjString* key) {
-    uint32_t index = key->hash % capacity;
-
-    Entry* tombstone = NULL;
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+// the slot holding key, or -1
+static inline int findKey(Table* table, ObjString* key) {
+    if (isSmall(table->capacity)) {
+        for (int i = 0; i < table->count; i++) {
+            if (table->entries[i].key == key) return i;
         }
+        return -1;
+    }
+    return probeKey(table->entries, table->capacity, key);
+}
 
-        index = (index + 1) % capacity;
+/**
+ * the slot holding key, or -1 and *free is where an insert of it goes: its
+ * home slot if that's free, else the first EMPTY or DELETED slot of the
+ * first group on its probe sequence that has one
+ */
+static int findSlot(Entry* entries, int capacity, ObjString* key,
+                    int* free) {
+    uint8_t* control = controlBytes(entries, capacity);
+    uint8_t byte = hashControl(key->hash);
+    int home = homeSlot(capacity, key->hash);
+    int groupMask = (capacity - 1) / GROUP_WIDTH;
+    int group = home / GROUP_WIDTH;
+    *free = (control[home] & CONTROL_EMPTY) != 0 ? home : -1;
+    for (int step = 1;; step++) {
+        int first = group * GROUP_WIDTH;
+        Group bytes = loadGroup(control + first);
+        for (Match match = matchByte(bytes, byte);
+             match != 0; match &= match - 1) {
+            int slot = first + lowestSlot(match);
+            if (entries[slot].key == key) return slot;
+        }
+        Match freeSlots = matchFree(bytes);
+        if (*free < 0 && freeSlots != 0) *free = first + lowestSlot(freeSlots);
+        if (matchEmpty(bytes) != 0 || step > groupMask) return -1;
+        group = (group + step) & groupMask;
     }
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+static void fillSlot(Entry* entries, int capacity, int slot, ObjString* key,
+                     Value value) {
+    setControl(controlBytes(entries, capacity), slot, hashControl(key->hash));
+    entries[slot].key = key;
+    entries[slot].value = value;
+}
+
+static Entry* allocateEntries(int capacity) {
+    Entry* entries = (Entry*)reallocate(NULL, 0, tableBytes(capacity));
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
+    if (isSmall(capacity)) return entries;
+    uint8_t* control = controlBytes(entries, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
+    memset(control + capacity, CONTROL_SENTINEL,
+           controlCount(capacity) - capacity);
+    return entries;
+}
+
+/**
+ * rehash into capacity slots, which drops the tombstones
+ */
+static void adjustCapacity(Table* table, int capacity) {
+    Entry* entries = allocateEntries(capacity);
 
-    //rehash all the entries
     table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        if (isSmall(capacity)) {
+            entries[table->count++] = *entry;
+            continue;
+        }
+        int free;
+        findSlot(entries, capacity, entry->key, &free);
+        fillSlot(entries, capacity, free, entry->key, entry->value);
         table->count++;
     }
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    reallocate(table->entries, tableBytes(table->capacity), 0);
 
     table->entries = entries;
     table->capacity = capacity;
 }
 
+bool tableSet(Table* table, ObjString* key, Value value) {
+    int free = -1;
+    int slot = isSmall(table->capacity)
+                       ? findKey(table, key)
+                       : findSlot(table->entries, table->capacity, key, &free);
+    if (slot >= 0) {
+        table->entries[slot].value = value;
+        return false;
+    }
+
+    if (table->count + 1 > maxLoad(table->capacity)) {
+        // mostly tombstones, a rehash at the same size makes room
+        int live = 0;
+        for (int i = 0; i < table->capacity; i++) {
+            if (table->entries[i].key != NULL) live++;
+        }
+        int capacity = table->capacity;
+        if (live + 1 > capacity / 2) {
+            capacity = capacity < TABLE_MIN_CAPACITY ? TABLE_MIN_CAPACITY
+                                                     : capacity * 2;
+        }
+        adjustCapacity(table, capacity);
+        if (!isSmall(capacity)) {
+            findSlot(table->entries, table->capacity, key, &free);
+        }
+    }
+
+    if (isSmall(table->capacity)) {
+        Entry* entry = &table->entries[table->count++];
+        entry->key = key;
+        entry->value = value;
+        return true;
+    }
+
+    // a tombstone is counted already
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    if (control[free] == CONTROL_EMPTY) table->count++;
+    fillSlot(table->entries, table->capacity, free, key, value);
+    return true;
+}
+
+void tableShrink(Table* table) {
+    if (table->capacity == 0) return;
+    int live = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) live++;
+    }
+    if (live == 0) {
+        freeTable(table);
+        return;
+    }
+
+    // half full after a shrink, far from growing again
+    int capacity = TABLE_MIN_CAPACITY;
+    while (capacity < live * 2) capacity *= 2;
+    if (capacity <= table->capacity / 4) {
+        adjustCapacity(table, capacity);
+    } else if (table->count - live > live) {
+        // probes go on past tombstones
+        adjustCapacity(table, table->capacity);
+    }
+}
+
 void tableAddAll(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
@@ -103,44 +371,82 @@ void tableAddAll(Table* from, Table* to) {
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findKey(table, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
+/**
+ * a probe stops at a group with an EMPTY slot, so none went past this
+ * slot's group if it has one, or if it's the only group: the slot is EMPTY
+ * again. otherwise it's a tombstone, probes go on past it
+ */
+static void removeSlot(Table* table, int slot) {
+    if (isSmall(table->capacity)) {
+        // the last entry fills the hole
+        Entry* last = &table->entries[--table->count];
+        table->entries[slot] = *last;
+        last->key = NULL;
+        last->value = NIL_VAL;
+        return;
+    }
+
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    int first = slot - slot % GROUP_WIDTH;
+    if (table->capacity <= GROUP_WIDTH ||
+        matchEmpty(loadGroup(control + first)) != 0) {
+        setControl(control, slot, CONTROL_EMPTY);
+        table->count--;
+    } else {
+        setControl(control, slot, CONTROL_DELETED);
+    }
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+}
+
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findKey(table, key);
+    if (slot < 0) return false;
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    removeSlot(table, slot);
     return true;
 }
 
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash) {
     if (table->count == 0) return NULL;
+    if (isSmall(table->capacity)) {
+        for (int i = 0; i < table->count; i++) {
+            ObjString* key = table->entries[i].key;
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
+        }
+        return NULL;
+    }
 
-    uint32_t index = hash % table->capacity;
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            //full compare. We found it.
-            return entry->key;
+    uint8_t* control = controlBytes(table->entries, table->capacity);
+    uint8_t byte = hashControl(hash);
+    int groupMask = (table->capacity - 1) / GROUP_WIDTH;
+    int group = homeSlot(table->capacity, hash) / GROUP_WIDTH;
+    for (int step = 1;; step++) {
+        int first = group * GROUP_WIDTH;
+        Group bytes = loadGroup(control + first);
+        for (Match match = matchByte(bytes, byte);
+             match != 0; match &= match - 1) {
+            ObjString* key = table->entries[first + lowestSlot(match)].key;
+            if (key != NULL && key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
-        //else encounter a tombstone, keep searching
-        index = (index + 1) % table->capacity;
+        if (matchEmpty(bytes) != 0 || step > groupMask) return NULL;
+        group = (group + step) & groupMask;
     }
 }
 
@@ -152,11 +458,28 @@ void markTable(Table* table) {
     }
 }
 
+void tableMoveKey(Table* table, ObjString* key, ObjString* moved) {
+    if (table->count == 0) return;
+    int slot = findKey(table, key);
+    if (slot >= 0) table->entries[slot].key = moved;
+}
+
 void tableRemoveWhite(Table* table) {
+    if (isSmall(table->capacity)) {
+        for (int i = 0; i < table->count;) {
+            if (!isMarked((Obj*)table->entries[i].key)) {
+                removeSlot(table, i);
+            } else {
+                i++;
+            }
+        }
+        return;
+    }
+
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        if (entry->key != NULL && !isMarked((Obj*)entry->key)) {
+            removeSlot(table, i);
         }
     }
-}
\ No newline at end of file
+}
@@ -19,15 +19,22 @@ typedef struct {
     Entry* entries;
 } Table;
 
+// bytes of a table's block: its entries, then a control byte for each
+size_t tableBytes(int capacity);
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
+// rehash a table that deletes left mostly empty or full of tombstones
+void tableShrink(Table* table);
 
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash);
 void markTable(Table* table);
 void tableRemoveWhite(Table* table);
+// the key was moved by a minor GC, its hash and so its slot stay the same
+void tableMoveKey(Table* table, ObjString* key, ObjString* moved);
 #endif
\ No newline at end of file
@@ -0,0 +1,219 @@
+// summarizes a heap snapshot: live bytes by type and by allocation site,
+// with the path from a root that keeps each site's objects alive
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_MAX_LENGTH 4096
+// hops of a retainer path printed from each end, the middle is elided
+#define PATH_HEAD 4
+#define PATH_TAIL 6
+
+typedef struct {
+    int line;
+    char* name;
+    char* path;
+    size_t objects;
+    size_t bytes;
+    // the first object from here, breadth first it's the closest to a root
+    int example;
+} Site;
+
+typedef struct {
+    int type;
+    size_t bytes;
+    int site;
+    int parent;
+    char* edge;
+} Object;
+
+typedef struct {
+    char* name;
+    size_t objects;
+    size_t bytes;
+} Type;
+
+static Site* sites = NULL;
+static int siteCount = 0;
+static Object* objects = NULL;
+static int objectCount = 0;
+static Type types[32];
+static int typeCount = 0;
+
+static void usage() {
+    fprintf(stderr, "Usage: heapreport [--top n] snapshot\n");
+    exit(64);
+}
+
+static void* grow(void* array, int count, size_t size) {
+    // capacities are the powers of two
+    if (count == 0 || (count & (count - 1)) == 0) {
+        array = realloc(array, size * (size_t)(count == 0 ? 8 : count * 2));
+        if (array == NULL) exit(1);
+    }
+    return array;
+}
+
+static char* copyText(const char* text) {
+    size_t length = strlen(text);
+    char* copy = (char*)malloc(length + 1);
+    if (copy == NULL) exit(1);
+    memcpy(copy, text, length + 1);
+    return copy;
+}
+
+static int typeIndex(const char* name) {
+    for (int i = 0; i < typeCount; i++) {
+        if (strcmp(types[i].name, name) == 0) return i;
+    }
+    if (typeCount == (int)(sizeof(types) / sizeof(types[0]))) return -1;
+    types[typeCount].name = copyText(name);
+    types[typeCount].objects = 0;
+    types[typeCount].bytes = 0;
+    return typeCount++;
+}
+
+static void chomp(char* line) {
+    size_t length = strlen(line);
+    if (length > 0 && line[length - 1] == '\n') line[length - 1] = '\0';
+}
+
+static bool readSnapshot(FILE* file) {
+    char line[LINE_MAX_LENGTH];
+    if (fgets(line, sizeof(line), file) == NULL ||
+        strcmp(line, "clox heap snapshot 1\n") != 0) {
+        return false;
+    }
+
+    char name[LINE_MAX_LENGTH];
+    char rest[LINE_MAX_LENGTH];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        chomp(line);
+        int id;
+        int number;
+        if (sscanf(line, "site %d %d %s %[^\n]", &id, &number, name,
+                   rest) == 4) {
+            if (id != siteCount) return false;
+            sites = (Site*)grow(sites, siteCount, sizeof(Site));
+            Site* site = &sites[siteCount++];
+            site->line = number;
+            site->name = copyText(name);
+            site->path = copyText(rest);
+            site->objects = 0;
+            site->bytes = 0;
+            site->example = -1;
+            continue;
+        }
+
+        size_t bytes;
+        int site;
+        int parent;
+        if (sscanf(line, "object %d %s %zu %d %d %[^\n]", &id, name, &bytes,
+                   &site, &parent, rest) != 6 ||
+            id != objectCount || site < 0 || site >= siteCount ||
+            parent >= id) {
+            return false;
+        }
+        int type = typeIndex(name);
+        if (type < 0) return false;
+        objects = (Object*)grow(objects, objectCount, sizeof(Object));
+        Object* object = &objects[objectCount++];
+        object->type = type;
+        object->bytes = bytes;
+        object->site = site;
+        object->parent = parent;
+        object->edge = copyText(rest);
+
+        types[type].objects++;
+        types[type].bytes += bytes;
+        sites[site].objects++;
+        sites[site].bytes += bytes;
+        if (sites[site].example < 0) sites[site].example = id;
+    }
+    return !ferror(file);
+}
+
+static int compareSites(const void* a, const void* b) {
+    const Site* x = (const Site*)a;
+    const Site* y = (const Site*)b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+static int compareTypes(const void* a, const void* b) {
+    const Type* x = (const Type*)a;
+    const Type* y = (const Type*)b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+// the references from a root to the object, the root's end first
+static void printPath(int id) {
+    int length = 0;
+    for (int i = id; i >= 0; i = objects[i].parent) length++;
+    int* path = (int*)malloc(sizeof(int) * (size_t)length);
+    if (path == NULL) exit(1);
+    int index = length;
+    for (int i = id; i >= 0; i = objects[i].parent) path[--index] = i;
+
+    printf("%27s retained by ", "");
+    for (int i = 0; i < length; i++) {
+        if (length > PATH_HEAD + PATH_TAIL && i == PATH_HEAD) {
+            printf("... %d more > ", length - PATH_HEAD - PATH_TAIL);
+            i = length - PATH_TAIL;
+        }
+        printf("%s%s", objects[path[i]].edge, i + 1 < length ? " > " : "");
+    }
+    printf("\n");
+    free(path);
+}
+
+int main(int argc, const char* argv[]) {
+    const char* path = NULL;
+    int top = 10;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            char* end;
+            long count = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || count < 1 || count > 100000) usage();
+            top = (int)count;
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+    if (path == NULL) usage();
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    if (!readSnapshot(file)) {
+        fprintf(stderr, "\"%s\" is not a heap snapshot.\n", path);
+        exit(65);
+    }
+    fclose(file);
+
+    size_t total = 0;
+    for (int i = 0; i < typeCount; i++) total += types[i].bytes;
+    printf("%d objects, %zu bytes\n\n", objectCount, total);
+
+    qsort(types, (size_t)typeCount, sizeof(Type), compareTypes);
+    printf("%12s %12s  type\n", "bytes", "objects");
+    for (int i = 0; i < typeCount; i++) {
+        printf("%12zu %12zu  %s\n", types[i].bytes, types[i].objects,
+               types[i].name);
+    }
+
+    qsort(sites, (size_t)siteCount, sizeof(Site), compareSites);
+    printf("\n%12s %12s  allocation site\n", "bytes", "objects");
+    for (int i = 0; i < siteCount && i < top; i++) {
+        Site* site = &sites[i];
+        if (site->objects == 0) break;
+        printf("%12zu %12zu  %s %s:%d\n", site->bytes, site->objects,
+               site->name, site->path, site->line);
+        printPath(site->example);
+    }
+    return 0;
+}
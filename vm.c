@@ -1,7 +1,9 @@
 //
 // Created by lc on 2022/12/7.
 //
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
@@ -11,16 +13,156 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "module.h"
+#include "profiler.h"
 
 VM vm;
 
+// concatenations up to this long are copied, longer ones are ropes
+#define ROPE_MIN_LENGTH 257
+
+static int textLength(Value value) {
+    if (IS_ROPE(value)) return AS_ROPE(value)->length;
+    if (IS_SLICE(value)) return AS_SLICE(value)->length;
+    return AS_STRING(value)->length;
+}
+
+// the bytes of a string or slice
+static const char* textChars(Value value) {
+    if (IS_SLICE(value)) return sliceChars(AS_SLICE(value));
+    return AS_CSTRING(value);
+}
+
+// a string or slice argument made a string, false for anything else
+static bool stringArgument(Value* arg) {
+    if (IS_SLICE(*arg)) *arg = OBJ_VAL(internSlice(AS_SLICE(*arg)));
+    return IS_STRING(*arg);
+}
+
 static Value clockNative(int argCount, Value *args) {
     return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
+// heapSnapshot(path), false if the file can't be written
+static Value heapSnapshotNative(int argCount, Value *args) {
+    if (argCount != 1 || !stringArgument(&args[0])) return BOOL_VAL(false);
+    return BOOL_VAL(writeHeapSnapshot(AS_CSTRING(args[0])));
+}
+
+// gcStat("minorCollections"), nil for a name that isn't a counter
+static Value gcStatNative(int argCount, Value *args) {
+    double value;
+    if (argCount != 1 || !stringArgument(&args[0]) ||
+        !gcStatValue(AS_CSTRING(args[0]), &value)) {
+        return NIL_VAL;
+    }
+    return NUMBER_VAL(value);
+}
+
+// length(text), in bytes, or length(list), its element count
+static Value lengthNative(int argCount, Value *args) {
+    if (argCount != 1) return NIL_VAL;
+    if (IS_LIST(args[0])) return NUMBER_VAL(AS_LIST(args[0])->items.count);
+    if (!IS_TEXT(args[0])) return NIL_VAL;
+    return NUMBER_VAL(textLength(args[0]));
+}
+
+// a whole number from 0 to limit, -1 for anything else
+static int indexArgument(Value value, int limit) {
+    if (!IS_NUMBER(value)) return -1;
+    double number = AS_NUMBER(value);
+    if (!(number >= 0 && number <= limit) || number != (int)number) {
+        return -1;
+    }
+    return (int)number;
+}
+
+/**
+ * substring(text, start, end), the bytes from start up to end. nil unless
+ * 0 <= start <= end <= length(text). longer results share the bytes of
+ * the text
+ */
+static Value substringNative(int argCount, Value *args) {
+    if (argCount != 3 || !IS_TEXT(args[0])) return NIL_VAL;
+    int length = textLength(args[0]);
+    int start = indexArgument(args[1], length);
+    int end = indexArgument(args[2], length);
+    if (start < 0 || end < start) return NIL_VAL;
+    if (start == 0 && end == length) return args[0];
+
+    int count = end - start;
+    if (sizeof(ObjString) + count + 1 <= sizeof(ObjSlice)) {
+        // a copy is no bigger than a slice. it's interned, a tokenizer
+        // takes the same few characters over and over
+        return OBJ_VAL(copyString(textChars(args[0]) + start, count));
+    }
+    if (IS_SLICE(args[0])) {
+        ObjSlice* slice = AS_SLICE(args[0]);
+        return OBJ_VAL(newSlice(slice->parent, slice->start + start, count));
+    }
+    return OBJ_VAL(newSlice(AS_STRING(args[0]), start, count));
+}
+
+/**
+ * a new list's elements, copied in with a single allocation. the list must
+ * be reachable
+ */
+static void fillList(ObjList* list, const Value* values, int count) {
+    if (count == 0) return;
+    Value* items = GROW_ARRAY(Value, NULL, 0, count);
+    memcpy(items, values, sizeof(Value) * count);
+    list->items.values = items;
+    list->items.capacity = count;
+    list->items.count = count;
+    writeBarrierAll((Obj*)list);
+}
+
+// append(list, value), the list
+static Value appendNative(int argCount, Value *args) {
+    if (argCount != 2 || !IS_LIST(args[0])) return NIL_VAL;
+    ObjList* list = AS_LIST(args[0]);
+    // the marker thread may be reading the elements
+    lockHeap();
+    writeValueArray(&list->items, args[1]);
+    unlockHeap();
+    WRITE_BARRIER(list, args[1]);
+    return args[0];
+}
+
+// pop(list), its last element, nil once it's empty
+static Value popNative(int argCount, Value *args) {
+    if (argCount != 1 || !IS_LIST(args[0])) return NIL_VAL;
+    ObjList* list = AS_LIST(args[0]);
+    if (list->items.count == 0) return NIL_VAL;
+    lockHeap();
+    Value value = list->items.values[--list->items.count];
+    // it may be stored somewhere the snapshot has already been traced
+    shadeValue(value);
+    unlockHeap();
+    return value;
+}
+
+/**
+ * slice(list, start, end), a new list of the elements from start up to
+ * end. nil unless 0 <= start <= end <= length(list)
+ */
+static Value sliceNative(int argCount, Value *args) {
+    if (argCount != 3 || !IS_LIST(args[0])) return NIL_VAL;
+    int count = AS_LIST(args[0])->items.count;
+    int start = indexArgument(args[1], count);
+    int end = indexArgument(args[2], count);
+    if (start < 0 || end < start) return NIL_VAL;
+
+    ObjList* slice = newList();
+    push(OBJ_VAL(slice));
+    fillList(slice, AS_LIST(args[0])->items.values + start, end - start);
+    pop();
+    return OBJ_VAL(slice);
+}
+
 static void resetStack();
 
-static void concatenate();
+static bool concatenate();
 
 static bool call(ObjClosure *closure, int argCount);
 
@@ -35,25 +177,96 @@ void initVM() {
     vm.objects = NULL;
     initTable(&vm.strings);
     initTable(&vm.globals);
+    initTable(&vm.modules);
+    vm.mainModule = NULL;
 
-    //for GC
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
-    defineNative("clock", clockNative);
-
+    //GC state before the first allocation
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.slices = NULL;
+    vm.sliceCount = 0;
+    vm.sliceCapacity = 0;
 
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.gcPhase = GC_IDLE;
+    vm.gcSliceBudget = 0;
+    vm.gcConcurrent = false;
+    vm.nextSlice = 0;
+    vm.sweepList = NULL;
+    vm.sweepTail = NULL;
+    vm.gcCompact = false;
+    vm.compactPending = false;
+    vm.gcGrowFactor = 2;
+    vm.gcMinHeap = 0;
+    vm.gcMaxHeap = 0;
+    vm.gcTargetFraction = 0;
+    vm.gcStats = false;
+    vm.gcPauses = NULL;
+    vm.gcPauseCount = 0;
+    vm.gcPauseCapacity = 0;
+    vm.heapProfile = false;
+    initNursery();
+
+    vm.initString = NULL;
+    vm.initString = copyString("init", 4);
+    vm.mainModule = newModule(NULL);
+    defineNative("clock", clockNative);
+    defineNative("gcStat", gcStatNative);
+    defineNative("heapSnapshot", heapSnapshotNative);
+    defineNative("length", lengthNative);
+    defineNative("substring", substringNative);
+    defineNative("append", appendNative);
+    defineNative("pop", popNative);
+    defineNative("slice", sliceNative);
+
+    vm.lazyCompile = false;
+    vm.sources = NULL;
+    vm.sourceCount = 0;
+    vm.sourceCapacity = 0;
 }
 
 void freeVM() {
     freeTable(&vm.globals);
     freeTable(&vm.strings);
+    freeTable(&vm.modules);
     vm.initString = NULL;
+    vm.mainModule = NULL;
+    if (vm.heapProfile) {
+        vm.heapProfile = false;
+        freeProfile();
+    }
     freeObjects();
+
+    for (int i = 0; i < vm.sourceCount; i++) {
+        freeSource(&vm.sources[i]);
+    }
+    free(vm.sources);
+}
+
+/**
+ * lazy function bodies point into their source, keep it until freeVM
+ */
+static void retainSource(Source source) {
+    if (vm.sourceCapacity < vm.sourceCount + 1) {
+        vm.sourceCapacity = vm.sourceCapacity < 8 ? 8 : vm.sourceCapacity * 2;
+        vm.sources = (Source*)realloc(vm.sources,
+                                      sizeof(Source) * vm.sourceCapacity);
+        if (vm.sources == NULL) exit(1);
+    }
+    vm.sources[vm.sourceCount++] = source;
+}
+
+/**
+ * a compiled source is no longer needed, unless lazy bodies point into it
+ */
+void releaseSource(Source source) {
+    if (vm.lazyCompile) {
+        retainSource(source);
+    } else {
+        freeSource(&source);
+    }
 }
 
 static void resetStack() {
@@ -63,10 +276,7 @@ static void resetStack() {
 
 static InterpretResult run();
 
-InterpretResult interpret(const char *source) {
-    ObjFunction *function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-
+static InterpretResult runFunction(ObjFunction* function) {
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
@@ -76,6 +286,54 @@ InterpretResult interpret(const char *source) {
     return run();
 }
 
+static InterpretResult compileAndRun(const char *source) {
+    ObjFunction *function = compile(source, vm.mainModule);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return runFunction(function);
+}
+
+InterpretResult interpret(const char *source) {
+    if (vm.lazyCompile) {
+        // the caller's buffer (eg. a REPL line) may not outlive lazy bodies
+        Source copy;
+        copySource(&copy, source);
+        return interpretSource(copy, NULL);
+    }
+    return compileAndRun(source);
+}
+
+InterpretResult interpretSource(Source source, const char* path) {
+    // imports are relative to the main script, and may import it back
+    char resolved[SOURCE_PATH_MAX];
+    if (path != NULL && strcmp(path, "-") != 0 &&
+        resolveSourcePath(NULL, path, resolved, sizeof(resolved))) {
+        ObjString* key = copyString(resolved, (int)strlen(resolved));
+        lockHeap();
+        vm.mainModule->path = key;
+        unlockHeap();
+        writeBarrierAll((Obj*)vm.mainModule);
+        tableSet(&vm.modules, vm.mainModule->path, OBJ_VAL(vm.mainModule));
+    }
+
+    InterpretResult result;
+    if (vm.compileThreads > 1) {
+        if (compileModules(vm.mainModule, source, vm.compileThreads)) {
+            ObjFunction* function = vm.mainModule->function;
+            lockHeap();
+            shadeValue(OBJ_VAL(function));
+            vm.mainModule->function = NULL;
+            unlockHeap();
+            result = runFunction(function);
+        } else {
+            result = INTERPRET_COMPILE_ERROR;
+        }
+    } else {
+        result = compileAndRun(source.chars);
+    }
+    releaseSource(source);
+    return result;
+}
+
 static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
@@ -87,6 +345,14 @@ static Value peek(int distance) {
  * @return
  */
 static bool call(ObjClosure *closure, int argCount) {
+    // lazy compile mode, generate the body on first call
+    if (closure->function->lazy != NULL &&
+        !compileLazy(closure->function)) {
+        runtimeError("Could not compile function '%s'.",
+                     closure->function->name->chars);
+        return false;
+    }
+
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.",
                      closure->function->arity, argCount);
@@ -102,9 +368,28 @@ static bool call(ObjClosure *closure, int argCount) {
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+    frame->globals = &closure->function->module->globals;
     return true;
 }
 
+/**
+ * a rope on the stack is replaced by its string, the slot keeps it
+ * reachable meanwhile
+ */
+static void flattenSlot(Value* slot) {
+    if (IS_ROPE(*slot)) *slot = OBJ_VAL(flattenRope(AS_ROPE(*slot)));
+}
+
+// the same, or a slice copied out, then interned
+static void internSlot(Value* slot) {
+    flattenSlot(slot);
+    if (IS_SLICE(*slot)) {
+        *slot = OBJ_VAL(internSlice(AS_SLICE(*slot)));
+    } else {
+        *slot = OBJ_VAL(internString(AS_STRING(*slot)));
+    }
+}
+
 static bool callValue(Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
@@ -133,6 +418,11 @@ static bool callValue(Value callee, int argCount) {
                 return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
+                // natives see only flat strings
+                for (Value* arg = vm.stackTop - argCount; arg < vm.stackTop;
+                     arg++) {
+                    flattenSlot(arg);
+                }
                 Value result = native(argCount, vm.stackTop - argCount);
                 vm.stackTop -= argCount + 1;
                 push(result);
@@ -163,9 +453,27 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
     return call(AS_CLOSURE(method), argCount);
 }
 
+static bool getModuleVariable(ObjModule* module, ObjString* name,
+                              Value* value) {
+    if (!tableGet(&module->globals, name, value)) {
+        runtimeError("Undefined variable '%s' in module.", name->chars);
+        return false;
+    }
+    return true;
+}
+
 static bool invoke(ObjString* name, int argCount) {
     //get instance, instance is at the right slot
     Value receiver = peek(argCount);
+    if (IS_MODULE(receiver)) {
+        // module.function(), call the module's variable
+        Value value;
+        if (!getModuleVariable(AS_MODULE(receiver), name, &value)) {
+            return false;
+        }
+        vm.stackTop[-argCount - 1] = value;
+        return callValue(value, argCount);
+    }
     if (!IS_INSTANCE(receiver)) {
         runtimeError("Only instances have methods.");
         return false;
@@ -248,12 +556,64 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 }
 
 static void closeUpvalues(Value* last) {
+    lockHeap();
     while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        WRITE_BARRIER(upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
+    unlockHeap();
+}
+
+/**
+ * tableSet into the table of an object. while a concurrent mark runs the
+ * store is locked, and the value it replaces shaded
+ */
+static bool setField(Table* table, ObjString* key, Value value) {
+    if (vm.gcPhase != GC_CONCURRENT) return tableSet(table, key, value);
+    lockHeap();
+    Value old;
+    if (tableGet(table, key, &old)) shadeValue(old);
+    bool isNewKey = tableSet(table, key, value);
+    unlockHeap();
+    return isNewKey;
+}
+
+// false for NaN and fractions. doubles from 2^52 up have no fraction bits
+static bool isWholeNumber(double number) {
+    if (number != number) return false;
+    if (number >= 4503599627370496.0 || number <= -4503599627370496.0) {
+        return true;
+    }
+    return number == (double)(int64_t)number;
+}
+
+/**
+ * the list and index under the top of the stack, a runtime error unless
+ * the index is a whole number within the list
+ */
+static bool listIndex(ObjList** list, int* index) {
+    if (!IS_LIST(peek(1))) {
+        runtimeError("Only lists can be indexed.");
+        return false;
+    }
+    if (!IS_NUMBER(peek(0))) {
+        runtimeError("List index must be a number.");
+        return false;
+    }
+    if (!isWholeNumber(AS_NUMBER(peek(0)))) {
+        runtimeError("List index must be a whole number.");
+        return false;
+    }
+    *list = AS_LIST(peek(1));
+    *index = indexArgument(peek(0), (*list)->items.count - 1);
+    if (*index < 0) {
+        runtimeError("List index out of range.");
+        return false;
+    }
+    return true;
 }
 
 static void defineMethod(ObjString* name) {
@@ -261,7 +621,9 @@ static void defineMethod(ObjString* name) {
     //peek(1), ObjClass
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
+    setField(&klass->methods, name, method);
+    WRITE_BARRIER(klass, OBJ_VAL(name));
+    WRITE_BARRIER(klass, method);
 
     //pop the ObjClosure for current method
     pop();
@@ -289,9 +651,90 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
     return true;
 }
 
+/**
+ * call a module's top level function, its result lands above the module
+ */
+static bool runModule(ObjFunction* function) {
+    push(OBJ_VAL(function));
+    ObjClosure* closure = newClosure(function);
+    pop();
+    push(OBJ_VAL(closure));
+    return call(closure, 0);
+}
+
+/**
+ * push the module at path, relative to the importing module, then the result
+ * of its top level code. a module is compiled and run by its first import
+ * only, later ones (also cyclic ones, while it still runs) get the cached
+ * module and nil.
+ */
+static bool importModule(ObjModule* from, ObjString* path) {
+    char resolved[SOURCE_PATH_MAX];
+    if (!resolveSourcePath(from->path == NULL ? NULL : from->path->chars,
+                           path->chars, resolved, sizeof(resolved))) {
+        runtimeError("Could not find module '%s'.", path->chars);
+        return false;
+    }
+
+    ObjString* key = copyString(resolved, (int)strlen(resolved));
+    Value cached;
+    if (tableGet(&vm.modules, key, &cached)) {
+        ObjModule* module = AS_MODULE(cached);
+        if (module->compileErrors != NULL) {
+            // compiled ahead of time, reported the way a compile here would
+            fputs(module->compileErrors, stderr);
+            free(module->compileErrors);
+            module->compileErrors = NULL;
+            tableDelete(&vm.modules, key);
+            runtimeError("Could not compile module '%s'.", path->chars);
+            return false;
+        }
+        push(cached);
+        if (module->function == NULL) {
+            push(NIL_VAL);
+            return true;
+        }
+        // compiled ahead of time, this first import runs it
+        ObjFunction* function = module->function;
+        lockHeap();
+        shadeValue(OBJ_VAL(function));
+        module->function = NULL;
+        unlockHeap();
+        return runModule(function);
+    }
+
+    Source source;
+    if (!readSource(&source, resolved)) {
+        runtimeError("Could not read module '%s'.", path->chars);
+        return false;
+    }
+
+    push(OBJ_VAL(key));
+    ObjModule* module = newModule(key);
+    pop();
+    push(OBJ_VAL(module));
+    tableSet(&vm.modules, key, OBJ_VAL(module));
+
+    ObjFunction* function = compile(source.chars, module);
+    releaseSource(source);
+    if (function == NULL) {
+        tableDelete(&vm.modules, key);
+        runtimeError("Could not compile module '%s'.", path->chars);
+        return false;
+    }
+    return runModule(function);
+}
+
 static InterpretResult run() {
     CallFrame *frame = &vm.frames[vm.frameCount - 1];
 
+// between instructions nothing but the VM holds objects, young ones can move.
+// calls, returns and loops come often enough to empty a full nursery
+#define SAFEPOINT() \
+    do { \
+      if (vm.nurseryFull) collectNursery(); \
+    } while (false)
+
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() \
     (frame->ip += 2, \
@@ -314,6 +757,10 @@ static InterpretResult run() {
     } while (false)
 
     for (;;) {
+#ifdef DEBUG_STRESS_GC
+        // every instruction boundary, to shake out missing barriers
+        SAFEPOINT();
+#endif
 #ifdef DEBUG_TRACE_EXECUTION
         print_stack();
         disassembleInstruction(&frame->closure->function->chunk,
@@ -330,6 +777,7 @@ static InterpretResult run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
+                SAFEPOINT();
                 break;
             }
             case OP_GET_SUPER: {
@@ -353,7 +801,10 @@ static InterpretResult run() {
                 }
 
                 // copy from super methods
+                lockHeap();
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+                unlockHeap();
+                writeBarrierAll((Obj*)subclass);
                 pop(); // Subclass.
                 // leave super class on stack top, why?
                 // because at compile time(classDeclaration), we make super class a Local,
@@ -367,12 +818,23 @@ static InterpretResult run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
+                SAFEPOINT();
                 break;
             }
             case OP_METHOD:
                 defineMethod(READ_STRING());
                 break;
             case OP_GET_PROPERTY: {
+                if (IS_MODULE(peek(0))) {
+                    Value value;
+                    if (!getModuleVariable(AS_MODULE(peek(0)), READ_STRING(),
+                                           &value)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    pop(); // Module.
+                    push(value);
+                    break;
+                }
                 // stack top is instance
                 if (!IS_INSTANCE(peek(0))) {
                     runtimeError("Only instances have properties.");
@@ -396,17 +858,60 @@ static InterpretResult run() {
                 break;
             }
             case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
+                Table* fields;
+                if (IS_MODULE(peek(1))) {
+                    fields = &AS_MODULE(peek(1))->globals;
+                } else if (IS_INSTANCE(peek(1))) {
+                    fields = &AS_INSTANCE(peek(1))->fields;
+                } else {
                     runtimeError("Only instances have fields.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                ObjString* name = READ_STRING();
+                setField(fields, name, peek(0));
+                WRITE_BARRIER(AS_OBJ(peek(1)), OBJ_VAL(name));
+                WRITE_BARRIER(AS_OBJ(peek(1)), peek(0));
                 Value value = pop();
                 pop();
                 push(value);
                 break;
             }
+            case OP_BUILD_LIST: {
+                int itemCount = READ_BYTE();
+                ObjList* list = newList();
+                push(OBJ_VAL(list));
+                fillList(list, vm.stackTop - 1 - itemCount, itemCount);
+                vm.stackTop -= itemCount + 1;
+                push(OBJ_VAL(list));
+                break;
+            }
+            case OP_GET_INDEX: {
+                ObjList* list;
+                int index;
+                if (!listIndex(&list, &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                Value value = list->items.values[index];
+                vm.stackTop -= 2;
+                push(value);
+                break;
+            }
+            case OP_SET_INDEX: {
+                Value value = pop();
+                ObjList* list;
+                int index;
+                if (!listIndex(&list, &index)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                lockHeap();
+                shadeValue(list->items.values[index]);
+                list->items.values[index] = value;
+                unlockHeap();
+                WRITE_BARRIER(list, value);
+                vm.stackTop -= 2;
+                push(value);
+                break;
+            }
             case OP_CLASS:
                 push(OBJ_VAL(newClass(READ_STRING())));
                 break;
@@ -428,6 +933,8 @@ static InterpretResult run() {
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    // capturing allocates, the closure may be old or black
+                    WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));
                 }
                 break;
             }
@@ -438,7 +945,16 @@ static InterpretResult run() {
             }
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+                if (vm.gcPhase == GC_CONCURRENT) {
+                    lockHeap();
+                    shadeValue(*upvalue->location);
+                    *upvalue->location = peek(0);
+                    unlockHeap();
+                } else {
+                    *upvalue->location = peek(0);
+                }
+                WRITE_BARRIER(upvalue, peek(0));
                 break;
             }
             case OP_CALL: {
@@ -451,11 +967,13 @@ static InterpretResult run() {
                 }
                 //frame point to the new frame of this invocation
                 frame = &vm.frames[vm.frameCount - 1];
+                SAFEPOINT();
                 break;
             }
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
+                SAFEPOINT();
                 break;
             }
             case OP_JUMP: {
@@ -480,8 +998,14 @@ static InterpretResult run() {
             }
             case OP_SET_GLOBAL: {
                 ObjString *name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
+                Value builtin;
+                WRITE_BARRIER(frame->closure->function->module, peek(0));
+                if (setField(frame->globals, name, peek(0)) &&
+                    !tableGet(&vm.globals, name, &builtin)) {
+                    // assigning a builtin shadows it in this module
+                    lockHeap();
+                    tableDelete(frame->globals, name);
+                    unlockHeap();
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -490,7 +1014,8 @@ static InterpretResult run() {
             case OP_GET_GLOBAL: {
                 ObjString *name = READ_STRING();
                 Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
+                if (!tableGet(frame->globals, name, &value) &&
+                    !tableGet(&vm.globals, name, &value)) {
                     runtimeError("Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -499,7 +1024,9 @@ static InterpretResult run() {
             }
             case OP_DEFINE_GLOBAL: {
                 ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
+                setField(frame->globals, name, peek(0));
+                WRITE_BARRIER(frame->closure->function->module, OBJ_VAL(name));
+                WRITE_BARRIER(frame->closure->function->module, peek(0));
                 pop();
                 break;
             }
@@ -526,6 +1053,7 @@ static InterpretResult run() {
                 // push return value
                 push(result);
                 frame = &vm.frames[vm.frameCount - 1];
+                SAFEPOINT();
                 break;
             }
             case OP_NEGATE:
@@ -545,6 +1073,11 @@ static InterpretResult run() {
                 push(BOOL_VAL(false));
                 break;
             case OP_EQUAL: {
+                // equal strings are the same interned one
+                if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+                    internSlot(vm.stackTop - 1);
+                    internSlot(vm.stackTop - 2);
+                }
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
@@ -557,8 +1090,8 @@ static InterpretResult run() {
                 BINARY_OP(BOOL_VAL, <);
                 break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
+                if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+                    if (!concatenate()) return INTERPRET_RUNTIME_ERROR;
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
@@ -582,6 +1115,15 @@ static InterpretResult run() {
             case OP_NOT:
                 push(BOOL_VAL(isFalsey(pop())));
                 break;
+            case OP_IMPORT: {
+                ObjString* path = READ_STRING();
+                if (!importModule(frame->closure->function->module, path)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                SAFEPOINT();
+                break;
+            }
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
                 push(constant);
@@ -594,6 +1136,7 @@ static InterpretResult run() {
 #undef READ_STRING
 #undef READ_BYTE
 #undef BINARY_OP
+#undef SAFEPOINT
 }
 
 
@@ -617,18 +1160,42 @@ void print_stack() {
     printf("\n");
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+// a string, or a rope's string if it was flattened already
+static Obj* textPiece(Value value) {
+    if (IS_ROPE(value) && AS_ROPE(value)->flat != NULL) {
+        return (Obj*)AS_ROPE(value)->flat;
+    }
+    return AS_OBJ(value);
+}
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+static bool concatenate() {
+    int lengthA = textLength(peek(1));
+    int lengthB = textLength(peek(0));
+    if (lengthA > INT_MAX - lengthB) {
+        runtimeError("String is too long.");
+        return false;
+    }
 
-    ObjString *result = takeString(chars, length);
+    int length = lengthA + lengthB;
+    Value result;
+    if (lengthB == 0) {
+        result = peek(1);
+    } else if (lengthA == 0) {
+        result = peek(0);
+    } else if (length < ROPE_MIN_LENGTH) {
+        // strings or slices, a rope is longer. not hashed or interned
+        // until == needs it, most results are only printed or appended to
+        ObjString* string = allocateString(length);
+        memcpy(string->chars, textChars(peek(1)), lengthA);
+        memcpy(string->chars + lengthA, textChars(peek(0)), lengthB);
+        result = OBJ_VAL(string);
+    } else {
+        // the bytes are copied once, when the result is flattened
+        result = OBJ_VAL(newRope(textPiece(peek(1)), textPiece(peek(0)),
+                                 length));
+    }
     pop();
     pop();
-    push(OBJ_VAL(result));
+    push(result);
+    return true;
 }
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "memory.h"
+#include "source.h"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
@@ -20,6 +22,8 @@ typedef struct {
     uint8_t* ip;
     // first slot of this function call in vm.stack
     Value* slots;
+    // globals of the function's module
+    Table* globals;
 } CallFrame;
 
 typedef enum {
@@ -28,6 +32,15 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+typedef enum {
+    GC_IDLE,
+    // incremental marking, the gray stack isn't empty yet
+    GC_MARK,
+    // a helper thread marks while the program runs
+    GC_CONCURRENT,
+    // marking done, unmarked objects of sweepList are freed
+    GC_SWEEP
+} GCPhase;
 
 typedef struct {
 
@@ -36,8 +49,12 @@ typedef struct {
 
     Value stack[STACK_MAX];
     Value* stackTop;
-    //global variables
+    //builtins (native functions), visible from every module
     Table globals;
+    //loaded modules by canonical path, each is run once
+    Table modules;
+    //module of the main script and the REPL
+    ObjModule* mainModule;
     //hash table
     Table strings;
     //keep track of all objects for freeing them
@@ -51,9 +68,65 @@ typedef struct {
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    // slices traced while their parent was still unmarked
+    ObjSlice** slices;
+    int sliceCount;
+    int sliceCapacity;
     //for adjusting GC parameters
     size_t bytesAllocated;
     size_t nextGC;
+    GCPhase gcPhase;
+    // objects traced or swept per slice, 0 collects all at once
+    int gcSliceBudget;
+    // mark on a helper thread
+    bool gcConcurrent;
+    // allocation that triggers the next slice of a running cycle
+    size_t nextSlice;
+    // objects of the cycle, unmarked ones are unlinked as the sweep passes.
+    // survivors stay in place and join objects once it's done
+    Obj* sweepList;
+    // the last survivor swept, NULL while the sweep is at the start
+    Obj* sweepTail;
+    // move old objects out of fragmented slab pages after a full GC
+    bool gcCompact;
+    // compact after the next minor GC
+    bool compactPending;
+    // the threshold after a cycle is the live heap times this
+    double gcGrowFactor;
+    // bounds of that threshold, 0 is no maximum
+    size_t gcMinHeap;
+    size_t gcMaxHeap;
+    // share of the time the collector may take, instead of the grow factor.
+    // 0 is off
+    double gcTargetFraction;
+    // record pause times, print them and the telemetry at exit
+    bool gcStats;
+    double* gcPauses;
+    int gcPauseCount;
+    int gcPauseCapacity;
+    GCTelemetry gcTelemetry;
+    // record allocation sites for heap snapshots
+    bool heapProfile;
+
+    // young generation, bump allocated, emptied by a minor GC
+    uint8_t* nursery;
+    uint8_t* nurseryTop;
+    uint8_t* nurseryEnd;
+    // collect the nursery at the next instruction boundary
+    bool nurseryFull;
+    // old objects that may point into the nursery
+    Obj** remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+
+    // lazy compile mode, function bodies are compiled on first call
+    bool lazyCompile;
+    // more than one compiles all modules up front, on this many threads
+    int compileThreads;
+    // sources kept alive for lazily compiled function bodies
+    Source* sources;
+    int sourceCount;
+    int sourceCapacity;
 } VM;
 
 extern VM vm;
@@ -61,6 +134,10 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+// takes ownership of the source, path names the main module
+InterpretResult interpretSource(Source source, const char* path);
+// done compiling a source, it's kept if lazy bodies point into it
+void releaseSource(Source source);
 void push(Value value);
 Value pop();
 